@@ -0,0 +1,137 @@
+/*
+
+Host benchmark for the HTTP response parser in lib/http. Parses fixture responses shaped like
+the Groundlight API's, fed in pieces the size of the reads the firmware makes, and reports the
+parsing throughput and time per response. Every parse is checked against the fixture's body.
+
+Build and run with PlatformIO:
+
+  pio run -e native_http
+  .pio/build/native_http/program [iterations]
+
+*/
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "http_response.h"
+
+struct fixture
+{
+  const char *name;
+  std::string response;
+  std::string body;
+};
+
+static long elapsed_us(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Headers like the ones the API sends in front of a body
+static std::string headers(int status, const char *framing)
+{
+  char status_line[64];
+  snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n", status, status == 201 ? "Created" : "OK");
+  return std::string(status_line)
+    + "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+      "Content-Type: application/json\r\n"
+    + framing
+    + "Connection: keep-alive\r\n"
+      "Vary: Accept, Origin, Cookie\r\n"
+      "Allow: GET, POST, HEAD, OPTIONS\r\n"
+      "X-Frame-Options: DENY\r\n"
+      "X-Content-Type-Options: nosniff\r\n"
+      "Referrer-Policy: same-origin\r\n"
+      "Cross-Origin-Opener-Policy: same-origin\r\n"
+      "\r\n";
+}
+
+static std::string image_query_body(int i)
+{
+  char body[512];
+  snprintf(body, sizeof(body),
+           "{\"id\":\"iq_2Xk9%06d\",\"type\":\"image_query\",\"created_at\":\"2026-10-17T12:00:00.000000Z\","
+           "\"query\":\"Is the door open?\",\"detector_id\":\"det_2Xk9Lq0ZpYbF3wR\",\"result_type\":\"binary_classification\","
+           "\"result\":{\"confidence\":0.734,\"label\":\"YES\",\"source\":\"ALGORITHM\"},"
+           "\"patience_time\":30.0,\"confidence_threshold\":0.9,\"metadata\":null}", i);
+  return body;
+}
+
+static fixture content_length_fixture(const char *name, int status, const std::string &body)
+{
+  return { name, headers(status, ("Content-Length: " + std::to_string(body.size()) + "\r\n").c_str()) + body, body };
+}
+
+static fixture chunked_fixture(const char *name, const std::string &body, size_t chunk_size)
+{
+  std::string response = headers(200, "Transfer-Encoding: chunked\r\n");
+  for (size_t pos = 0; pos < body.size(); pos += chunk_size) {
+    std::string chunk = body.substr(pos, chunk_size);
+    char size[16];
+    snprintf(size, sizeof(size), "%zx\r\n", chunk.size());
+    response += size + chunk + "\r\n";
+  }
+  response += "0\r\n\r\n";
+  return { name, response, body };
+}
+
+static std::string detector_list_body(int count)
+{
+  std::string body = "{\"count\":" + std::to_string(count) + ",\"next\":null,\"previous\":null,\"results\":[";
+  for (int i = 0; i < count; i++) {
+    char detector[512];
+    snprintf(detector, sizeof(detector),
+             "%s{\"id\":\"det_2Xk9Lq0ZpYbF%04d\",\"type\":\"detector\",\"created_at\":\"2026-10-17T12:00:00.000000Z\","
+             "\"name\":\"door-%d\",\"query\":\"Is the door open?\",\"group_name\":\"default\","
+             "\"confidence_threshold\":0.9,\"patience_time\":30.0,\"metadata\":null,\"mode\":\"BINARY\"}",
+             i ? "," : "", i, i);
+    body += detector;
+  }
+  return body + "]}";
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  fixture fixtures[] = {
+    content_length_fixture("image query", 201, image_query_body(1)),
+    chunked_fixture("image query, chunked", image_query_body(2), 128),
+    content_length_fixture("detector list", 200, detector_list_body(50)),
+    chunked_fixture("detector list, chunked", detector_list_body(50), 1024),
+  };
+  // the firmware reads 512 bytes at a time, TLS records hand over up to 16 KB
+  size_t read_sizes[] = { 64, 512, 1460, 16384 };
+  static char body[32768];
+  http_response response;
+  bool ok = true;
+
+  printf("%-24s %10s %10s %12s %10s\n", "fixture", "bytes", "read size", "us/response", "MB/s");
+  for (fixture &f : fixtures) {
+    const uint8_t *data = (const uint8_t *) f.response.data();
+    size_t len = f.response.size();
+    for (size_t read_size : read_sizes) {
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < iterations; i++) {
+        http_response_init(&response, body, sizeof(body));
+        http_response_result result = HTTP_RESPONSE_MORE;
+        for (size_t pos = 0; pos < len && result == HTTP_RESPONSE_MORE;) {
+          size_t used;
+          result = http_response_feed(&response, data + pos, len - pos < read_size ? len - pos : read_size, &used);
+          pos += used;
+        }
+        if (result != HTTP_RESPONSE_DONE || response.body_len != f.body.size() || memcmp(body, f.body.data(), f.body.size()) != 0) {
+          printf("ERROR: %s read %zu bytes at a time parsed wrong\n", f.name, read_size);
+          ok = false;
+          break;
+        }
+      }
+      double us = (double) elapsed_us(start) / iterations;
+      printf("%-24s %10zu %10zu %12.2f %10.1f\n", f.name, len, read_size, us, len / us);
+    }
+  }
+  return ok ? 0 : 1;
+}
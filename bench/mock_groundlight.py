@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""Local stand-in for the Groundlight device API, for benchmarking the firmware's connection
+handling without a Groundlight account or an internet round trip.
+
+Serves the requests the firmware makes, over HTTPS with HTTP/1.1 keep-alive:
+
+  POST  /device-api/v1/image-queries?detector_id=<id>   answers unconfident
+  GET   /device-api/v1/image-queries/<id>               confident after --polls polls or --answer-ms
+  GET   /device-api/v1/detectors
+  PATCH /device-api/predictors/<id>
+  GET   /mock/stats                                     connections and requests so far
+
+Every connection is logged with the number of requests it carried when it closes, so the
+TLS handshakes per image query can be read straight off the output, and with whether the
+client resumed an earlier TLS session when it opens.
+
+With --long-poll, an image query submitted or fetched with ?wait=<seconds> is held until it is
+confident or the wait is up, the way a server supporting long polls would. Without it the
+parameter is ignored, like a server that doesn't support it.
+"""
+
+import argparse
+import itertools
+import json
+import os
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+stats_lock = threading.Lock()
+stats = {"connections": 0, "resumed_sessions": 0, "requests": 0, "image_queries": 0, "polls": 0, "held": 0}
+polls_by_query = {}     # image query id: [polls so far, detector id, time submitted]
+query_ids = itertools.count(1)
+
+
+def count(key, n=1):
+    with stats_lock:
+        stats[key] += n
+        return stats[key]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        self.connection_id = count("connections")
+        self.connection_requests = 0
+        resumed = getattr(self.connection, "session_reused", False)
+        if resumed:
+            count("resumed_sessions")
+        self.log("connection %d opened%s" % (self.connection_id, ", resumed TLS session" if resumed else ""))
+
+    def finish(self):
+        super().finish()
+        self.log("connection %d closed after %d requests" % (self.connection_id, self.connection_requests))
+
+    def log(self, message):
+        if not self.server.quiet:
+            print("%.3f %s" % (time.time(), message), flush=True)
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status, body):
+        time.sleep(self.server.latency)
+        data = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        if self.server.chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            # two chunks, so a reader has to put the body back together
+            half = len(data) // 2
+            for part in (data[:half], data[half:], b""):
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+        else:
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+        self.connection_requests += 1
+        count("requests")
+
+    def read_body(self):
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def authenticated(self):
+        if self.headers.get("X-API-Token"):
+            return True
+        self.reply(401, {"detail": "Not authenticated."})
+        return False
+
+    def do_POST(self):
+        url = urlparse(self.path)
+        body = self.read_body()
+        if not self.authenticated():
+            return
+        if url.path != "/device-api/v1/image-queries":
+            return self.reply(404, {"detail": "Not found."})
+        if not body.startswith(b"\xff\xd8"):
+            return self.reply(400, {"detail": "Expected a JPEG image."})
+        query_id = "iq_mock%d" % next(query_ids)
+        detector_id = parse_qs(url.query).get("detector_id", [""])[0]
+        with stats_lock:
+            polls_by_query[query_id] = [0, detector_id, time.time()]
+        count("image_queries")
+        self.log("image query %s for %s, %d bytes" % (query_id, detector_id, len(body)))
+        self.hold(url, query_id)
+        with stats_lock:
+            query = list(polls_by_query[query_id])
+        self.reply(201, image_query(query_id, query))
+
+    def hold(self, url, query_id):
+        """Holds a request asking to wait until the query is confident or the wait is up"""
+        wait = float(parse_qs(url.query).get("wait", ["0"])[0])
+        if not args.long_poll or wait <= 0:
+            return
+        count("held")
+        deadline = time.time() + wait
+        while time.time() < deadline:
+            with stats_lock:
+                if confident(polls_by_query[query_id]):
+                    return
+            time.sleep(0.02)
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        path = url.path
+        self.read_body()
+        if path == "/mock/stats":
+            with stats_lock:
+                snapshot = dict(stats)
+            return self.reply(200, snapshot)
+        if not self.authenticated():
+            return
+        if path.startswith("/device-api/v1/image-queries/"):
+            query_id = path.rsplit("/", 1)[1]
+            with stats_lock:
+                known = query_id in polls_by_query
+            if not known:
+                return self.reply(404, {"detail": "Not found."})
+            self.hold(url, query_id)
+            with stats_lock:
+                query = polls_by_query[query_id]
+                query[0] += 1
+                query = list(query)
+            count("polls")
+            return self.reply(200, image_query(query_id, query))
+        if path == "/device-api/v1/detectors":
+            return self.reply(200, {"count": 1, "next": None, "previous": None, "results": [{
+                "id": "det_mock", "type": "detector", "created_at": "2023-01-01T00:00:00Z",
+                "name": "mock", "query": "Is this a mock?", "group_name": "mock",
+                "confidence_threshold": 0.9, "metadata": None}]})
+        self.reply(404, {"detail": "Not found."})
+
+    def do_PATCH(self):
+        self.read_body()
+        if not self.authenticated():
+            return
+        if not urlparse(self.path).path.startswith("/device-api/predictors/"):
+            return self.reply(404, {"detail": "Not found."})
+        self.reply(200, {})
+
+
+def confident(query):
+    polls, _, submitted = query
+    if args.answer_ms > 0:
+        return time.time() - submitted >= args.answer_ms / 1000
+    return polls >= args.polls
+
+
+def image_query(query_id, query):
+    answered = confident(query)
+    return {
+        "id": query_id,
+        "type": "image_query",
+        "detector_id": query[1],
+        "query": "Is this a mock?",
+        "result_type": "binary_classification",
+        "confidence_threshold": 0.9,
+        "done_processing": answered,
+        "result": {
+            "confidence": 0.95 if answered else 0.5,
+            "label": "YES" if answered else "UNSURE",
+        },
+    }
+
+
+def self_signed_cert(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                    "-nodes", "-days", "1", "-subj", "/CN=mock-groundlight", "-keyout", key, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument("--port", type=int, default=8443)
+parser.add_argument("--cert", help="PEM certificate, a self-signed one is made if not given")
+parser.add_argument("--key", help="PEM private key for --cert")
+parser.add_argument("--http", action="store_true", help="serve plain HTTP instead of HTTPS")
+parser.add_argument("--polls", type=int, default=3, help="polls before an image query turns confident")
+parser.add_argument("--answer-ms", type=int, default=0,
+                    help="time after submitting that an image query turns confident, instead of --polls")
+parser.add_argument("--long-poll", action="store_true", help="hold requests with a wait parameter")
+parser.add_argument("--latency-ms", type=int, default=0, help="delay before every response")
+parser.add_argument("--idle-timeout", type=float, default=60,
+                    help="seconds before an idle connection is closed, like a load balancer would")
+parser.add_argument("--chunked", action="store_true", help="send responses with chunked encoding")
+parser.add_argument("--quiet", action="store_true", help="only print the totals on exit")
+args = parser.parse_args()
+
+Handler.timeout = args.idle_timeout
+server = ThreadingHTTPServer(("", args.port), Handler)
+server.daemon_threads = True
+server.latency = args.latency_ms / 1000
+server.chunked = args.chunked
+server.quiet = args.quiet
+
+if not args.http:
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    with tempfile.TemporaryDirectory() as directory:
+        cert, key = (args.cert, args.key) if args.cert else self_signed_cert(directory)
+        context.load_cert_chain(cert, key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+
+print("mock Groundlight API on %s://0.0.0.0:%d" % ("http" if args.http else "https", args.port), flush=True)
+try:
+    server.serve_forever()
+except KeyboardInterrupt:
+    pass
+print("totals: %s" % json.dumps(stats), file=sys.stderr)
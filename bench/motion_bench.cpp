@@ -0,0 +1,702 @@
+/*
+
+Host benchmark for the motion detector. Replays a directory of recorded JPEG frames through
+the same motion code the firmware runs and reports decode time, diff time, frames/sec and
+trigger decisions. The luma detector used by the firmware is compared against the original
+per-channel RGB565 loop, both for speed and for agreement of the trigger decisions, and the
+DC-only thumbnail decoder is compared against the full decoder (libjpeg on the host) for speed,
+thumbnail error and agreement of the trigger decisions.
+
+Build and run with PlatformIO:
+
+  pio run -e native
+  .pio/build/native/program <frame_dir> [alpha] [beta] [--grid=<cell_alpha>] [--min-cells=<n>] [--mask=<cells>]
+    [--learning-rate=<rate>] [--normalize-lighting] [--deep-sleep] [--calibrate=<n>] [--crop=<padding>,<min_size>]
+    [--burst=<n>] [--debounce=<n>]
+
+alpha, beta, cell_alpha and the learning rate take the same 0-1 values as the motion_detection settings on the
+device, and --mask takes the same string of 80 '1'/'0' cells. --grid switches to grid mode
+and --learning-rate to the background model. --normalize-lighting rejects global lighting
+changes, which are counted separately. --deep-sleep simulates a deep sleep before every
+frame, so the firmware path only has the compact reference kept in RTC memory. --calibrate
+derives alpha, beta and the cell alphas from the first n frames, which must be a still scene,
+and replays the rest with them. --crop crops every frame with motion to the region with motion
+like crop_to_motion does, reports the crop size and time, and checks the crop's pixels against
+the same region of the full frame. --burst scores every frame like burst_frames does, picks the
+best of every n frames in a row and reports the scoring time. It also checks the score against
+a blurred copy of every frame, which should always score lower.
+Frames are replayed in file name order.
+
+After the replay the first frame is replayed again, followed by copies of it with a block
+painted in, and the frames are debounced like the motion monitor does with debounce_frames
+(--debounce, default 2). A change that stays in view must trigger once, on its n-th frame.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "esp_camera.h"
+#include "motion.h"
+#include "jpeg_crop.h"
+#include "frame_score.h"
+
+static long elapsed_us(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool has_jpeg_extension(const std::string &name)
+{
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+  std::string ext = name.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == "jpg" || ext == "jpeg";
+}
+
+static std::vector<std::string> list_frames(const char *dir)
+{
+  std::vector<std::string> frames;
+  DIR *d = opendir(dir);
+  if (!d) {
+    return frames;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (has_jpeg_extension(entry->d_name)) {
+      frames.push_back(std::string(dir) + "/" + entry->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(frames.begin(), frames.end());
+  return frames;
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> &out)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size);
+  bool ok = fread(out.data(), 1, size, f) == (size_t) size;
+  fclose(f);
+  return ok;
+}
+
+// Reads the frame dimensions from the first SOF marker
+static bool jpeg_dimensions(const std::vector<uint8_t> &jpg, size_t *width, size_t *height)
+{
+  size_t i = 2;
+  while (i + 9 < jpg.size()) {
+    if (jpg[i] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = jpg[i + 1];
+    size_t seg_len = (jpg[i + 2] << 8) | jpg[i + 3];
+    if (marker >= 0xC0 && marker <= 0xC3) {
+      *height = (jpg[i + 5] << 8) | jpg[i + 6];
+      *width = (jpg[i + 7] << 8) | jpg[i + 8];
+      return true;
+    }
+    i += 2 + seg_len;
+  }
+  return false;
+}
+
+// Reads a recorded frame into a camera frame buffer backed by jpg
+static bool load_frame(const std::string &path, std::vector<uint8_t> &jpg, camera_fb_t *fb)
+{
+  if (!read_file(path, jpg)) {
+    return false;
+  }
+  *fb = {};
+  fb->buf = jpg.data();
+  fb->len = jpg.size();
+  fb->format = PIXFORMAT_JPEG;
+  jpeg_dimensions(jpg, &fb->width, &fb->height);
+  return true;
+}
+
+struct gray_error_mgr
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf escape;
+};
+
+static void gray_error_exit(j_common_ptr cinfo)
+{
+  longjmp(((gray_error_mgr *) cinfo->err)->escape, 1);
+}
+
+// Decodes the luma of a JPEG at full size with libjpeg
+static bool decode_gray(const uint8_t *jpg, size_t len, std::vector<uint8_t> &out, int *width, int *height)
+{
+  struct jpeg_decompress_struct cinfo;
+  gray_error_mgr err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = gray_error_exit;
+  if (setjmp(err.escape)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *) jpg, len);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  jpeg_start_decompress(&cinfo);
+  *width = cinfo.output_width;
+  *height = cinfo.output_height;
+  out.resize((size_t) *width * *height);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = out.data() + (size_t) cinfo.output_scanline * *width;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+// Encodes a grayscale image with libjpeg
+static bool encode_gray(const std::vector<uint8_t> &pixels, int width, int height, int quality, std::vector<uint8_t> &out)
+{
+  struct jpeg_compress_struct cinfo;
+  gray_error_mgr err;
+  unsigned char *buf = NULL;
+  unsigned long len = 0;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = gray_error_exit;
+  if (setjmp(err.escape)) {
+    jpeg_destroy_compress(&cinfo);
+    free(buf);
+    return false;
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &buf, &len);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 1;
+  cinfo.in_color_space = JCS_GRAYSCALE;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = (JSAMPROW) pixels.data() + (size_t) cinfo.next_scanline * width;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  out.assign(buf, buf + len);
+  free(buf);
+  return true;
+}
+
+// Whether a frame outscores a copy of itself blurred over 5x5 pixels, both encoded again at the
+// same quality so only the blur differs
+static bool sharper_than_blurred(const std::vector<uint8_t> &jpg)
+{
+  std::vector<uint8_t> sharp;
+  int width;
+  int height;
+  if (!decode_gray(jpg.data(), jpg.size(), sharp, &width, &height)) {
+    return false;
+  }
+  std::vector<uint8_t> blurred(sharp.size());
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int sum = 0;
+      int count = 0;
+      for (int dy = -2; dy <= 2; dy++) {
+        for (int dx = -2; dx <= 2; dx++) {
+          int sx = x + dx;
+          int sy = y + dy;
+          if (sx >= 0 && sx < width && sy >= 0 && sy < height) {
+            sum += sharp[(size_t) sy * width + sx];
+            count++;
+          }
+        }
+      }
+      blurred[(size_t) y * width + x] = sum / count;
+    }
+  }
+
+  std::vector<uint8_t> sharp_jpg;
+  std::vector<uint8_t> blurred_jpg;
+  if (!encode_gray(sharp, width, height, 85, sharp_jpg) || !encode_gray(blurred, width, height, 85, blurred_jpg)) {
+    return false;
+  }
+  camera_fb_t sharp_fb = { sharp_jpg.data(), sharp_jpg.size(), (size_t) width, (size_t) height, PIXFORMAT_JPEG, {} };
+  camera_fb_t blurred_fb = { blurred_jpg.data(), blurred_jpg.size(), (size_t) width, (size_t) height, PIXFORMAT_JPEG, {} };
+  frame_score sharp_score;
+  frame_score blurred_score;
+  return score_frame(&sharp_fb, &sharp_score) && score_frame(&blurred_fb, &blurred_score)
+    && sharp_score.score > blurred_score.score;
+}
+
+// Whether the luma of a crop matches the same region of the full frame
+static bool crop_matches(const std::vector<uint8_t> &jpg, const uint8_t *crop, size_t crop_len, const jpeg_crop_rect &rect)
+{
+  std::vector<uint8_t> full;
+  std::vector<uint8_t> cropped;
+  int width;
+  int height;
+  int crop_width;
+  int crop_height;
+  if (!decode_gray(jpg.data(), jpg.size(), full, &width, &height)
+      || !decode_gray(crop, crop_len, cropped, &crop_width, &crop_height)
+      || crop_width != rect.width || crop_height != rect.height) {
+    return false;
+  }
+  for (int y = 0; y < rect.height; y++) {
+    if (memcmp(&cropped[(size_t) y * crop_width], &full[(size_t) (rect.y + y) * width + rect.x], rect.width) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The full decoder's reference, kept the way compare_motion_frame keeps the firmware's
+struct mirror_reference
+{
+  std::vector<uint8_t> luma_old = std::vector<uint8_t>(MOTION_LUMA_LEN, 0);
+  std::vector<uint8_t> normalized = std::vector<uint8_t>(MOTION_LUMA_LEN, 0);
+  std::vector<uint16_t> background = std::vector<uint16_t>(MOTION_LUMA_LEN, 0);
+  bool set = false;
+  bool seeded = false;
+};
+
+static motion_result mirror_compare(const motion_config &config, const uint8_t *luma, mirror_reference *ref)
+{
+  motion_result res = evaluate_motion(config, luma, ref->luma_old.data());
+  if (config.normalize_lighting && ref->set && res.motion) {
+    int gain;
+    int offset;
+    fit_lighting(config, luma, ref->luma_old.data(), &gain, &offset);
+    if (gain != MOTION_GAIN_ONE || offset != 0) {
+      normalize_lighting(luma, ref->normalized.data(), MOTION_LUMA_LEN, gain, offset);
+      res = evaluate_motion(config, ref->normalized.data(), ref->luma_old.data());
+      res.lighting_change = !res.motion;
+    }
+  }
+  if (config.learning_rate > 0) {
+    int rate = ref->seeded && !res.lighting_change ? config.learning_rate : MOTION_RATE_ONE;
+    update_background(ref->background.data(), ref->luma_old.data(), luma, MOTION_LUMA_LEN, rate);
+    ref->seeded = true;
+  } else if (res.motion || res.lighting_change) {
+    memcpy(ref->luma_old.data(), luma, MOTION_LUMA_LEN);
+  }
+  ref->set = true;
+  return res;
+}
+
+// Replays the first frame, then copies of it with a high contrast block over the middle of the
+// frame, through the firmware path with the motion monitor's debounce. Returns the number of
+// frames with the block it took to trigger, 0 if it never did, or -1 if it triggered again
+// while the block stayed.
+static int static_change_trigger_frame(const std::vector<uint8_t> &jpg, int debounce)
+{
+  std::vector<uint8_t> before;
+  int width;
+  int height;
+  if (!decode_gray(jpg.data(), jpg.size(), before, &width, &height)) {
+    return 0;
+  }
+  std::vector<uint8_t> after = before;
+  for (int y = height / 4; y < height * 3 / 4; y++) {
+    for (int x = width / 4; x < width * 3 / 4; x++) {
+      uint8_t *p = &after[(size_t) y * width + x];
+      *p = *p < 128 ? 255 : 0;
+    }
+  }
+  std::vector<uint8_t> before_jpg;
+  std::vector<uint8_t> after_jpg;
+  if (!encode_gray(before, width, height, 85, before_jpg) || !encode_gray(after, width, height, 85, after_jpg)) {
+    return 0;
+  }
+  camera_fb_t before_fb = { before_jpg.data(), before_jpg.size(), (size_t) width, (size_t) height, PIXFORMAT_JPEG, {} };
+  camera_fb_t after_fb = { after_jpg.data(), after_jpg.size(), (size_t) width, (size_t) height, PIXFORMAT_JPEG, {} };
+
+  // a quarter of the frame changes by at least half the luma range
+  motion_config config;
+  motion_default_config(&config, MOTION_LUMA_LEN / 100, MOTION_LUMA_MAX / 5);
+  config.hold_reference = debounce > 1;
+  motion_begin();
+  int frames_with_motion = 0;
+  int trigger_frame = 0;
+  for (int i = 0; i < 2 * debounce + 2; i++) {
+    bool changed = i >= debounce;
+    if (!decode_motion_frame(changed ? &after_fb : &before_fb)) {
+      return 0;
+    }
+    motion_result res = compare_motion_frame(config);
+    frames_with_motion = res.motion ? frames_with_motion + 1 : 0;
+    if (frames_with_motion >= debounce) {
+      motion_accept_frame(config);
+      frames_with_motion = 0;
+      // the first frames only take the scene in as the reference
+      if (changed) {
+        if (trigger_frame != 0) {
+          return -1;
+        }
+        trigger_frame = i - debounce + 1;
+      }
+    }
+  }
+  return trigger_frame;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<const char *> positional;
+  const char *grid_cell_alpha = NULL;
+  const char *mask = NULL;
+  int min_cells = 1;
+  float learning_rate = 0;
+  bool deep_sleep = false;
+  bool lighting = false;
+  int calibrate_frames = 0;
+  int crop_padding = -1;
+  int crop_min_size = 0;
+  int burst = 0;
+  int debounce = 2;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--grid=", 7) == 0) {
+      grid_cell_alpha = argv[i] + 7;
+    } else if (strncmp(argv[i], "--min-cells=", 12) == 0) {
+      min_cells = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--mask=", 7) == 0) {
+      mask = argv[i] + 7;
+    } else if (strncmp(argv[i], "--learning-rate=", 16) == 0) {
+      learning_rate = atof(argv[i] + 16);
+    } else if (strcmp(argv[i], "--normalize-lighting") == 0) {
+      lighting = true;
+    } else if (strcmp(argv[i], "--deep-sleep") == 0) {
+      deep_sleep = true;
+    } else if (strncmp(argv[i], "--calibrate=", 12) == 0) {
+      calibrate_frames = atoi(argv[i] + 12);
+    } else if (strncmp(argv[i], "--crop=", 7) == 0) {
+      crop_padding = atoi(argv[i] + 7);
+      const char *comma = strchr(argv[i] + 7, ',');
+      crop_min_size = comma ? atoi(comma + 1) : 0;
+    } else if (strncmp(argv[i], "--burst=", 8) == 0) {
+      burst = atoi(argv[i] + 8);
+    } else if (strncmp(argv[i], "--debounce=", 11) == 0) {
+      debounce = std::max(1, atoi(argv[i] + 11));
+    } else {
+      positional.push_back(argv[i]);
+    }
+  }
+  if (positional.empty()) {
+    fprintf(stderr, "usage: %s <frame_dir> [alpha] [beta] [--grid=<cell_alpha>] [--min-cells=<n>] [--mask=<cells>] [--learning-rate=<rate>] [--normalize-lighting] [--deep-sleep] [--calibrate=<n>] [--crop=<padding>,<min_size>] [--burst=<n>] [--debounce=<n>]\n",
+            argv[0]);
+    return 2;
+  }
+  float mot_a = positional.size() > 1 ? atof(positional[1]) : 0.1;
+  float mot_b = positional.size() > 2 ? atof(positional[2]) : 0.6;
+  int alpha = round(mot_a * (float) FRAME_ARR_LEN);
+  int beta = round(mot_b * (float) MOTION_LUMA_MAX);
+  int beta_rgb565 = round(mot_b * (float) COLOR_VAL_MAX);
+
+  motion_config config;
+  motion_default_config(&config, alpha, beta);
+  if (grid_cell_alpha) {
+    config.grid = true;
+    config.min_cells = min_cells;
+    int cell_alpha = round(atof(grid_cell_alpha) * (float) MOTION_CELL_PIXELS);
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+      config.cell_alpha[i] = cell_alpha;
+    }
+  }
+  config.normalize_lighting = lighting;
+  if (learning_rate > 0) {
+    config.learning_rate = std::min(MOTION_RATE_ONE, std::max(1, (int) round(learning_rate * MOTION_RATE_ONE)));
+  }
+  if (mask && motion_parse_cell_mask(mask, config.cell_included) != MOTION_GRID_CELLS) {
+    fprintf(stderr, "the mask needs %d cells\n", MOTION_GRID_CELLS);
+    return 2;
+  }
+
+  std::vector<std::string> frames = list_frames(positional[0]);
+  if (frames.empty()) {
+    fprintf(stderr, "no JPEG frames found in %s\n", positional[0]);
+    return 1;
+  }
+  if (!motion_begin()) {
+    fprintf(stderr, "failed to allocate motion buffers\n");
+    return 1;
+  }
+
+  std::vector<uint8_t> jpg;
+  if (calibrate_frames > 0) {
+    size_t burst = std::min((size_t) calibrate_frames, frames.size());
+    motion_calibration cal;
+    if (!motion_calibration_begin(&cal, burst)) {
+      fprintf(stderr, "calibration needs at least 4 frames\n");
+      return 2;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < burst; i++) {
+      camera_fb_t fb;
+      if (load_frame(frames[i], jpg, &fb) && decode_motion_frame(&fb)) {
+        motion_calibration_add_frame(&cal);
+      }
+    }
+    if (!motion_calibration_end(&cal, &config)) {
+      fprintf(stderr, "calibration failed, the first %zu frames are not a still scene\n", burst);
+      return 1;
+    }
+    long calibrate_us = elapsed_us(start);
+    alpha = config.alpha;
+    beta = config.beta;
+    beta_rgb565 = round(beta * (float) COLOR_VAL_MAX / MOTION_LUMA_MAX);
+    int max_cell_alpha = 0;
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+      max_cell_alpha = std::max(max_cell_alpha, (int) config.cell_alpha[i]);
+    }
+    printf("calibrated on %zu frames in %ld us: alpha %.4f beta %.3f max cell_alpha %.3f\n", burst, calibrate_us,
+           (float) alpha / FRAME_ARR_LEN, (float) beta / MOTION_LUMA_MAX, (float) max_cell_alpha / MOTION_CELL_PIXELS);
+    frames.erase(frames.begin(), frames.begin() + burst);
+  }
+
+  printf("alpha=%d beta=%d (rgb565 beta=%d) mode=%s reference=%s frames=%zu\n", alpha, beta, beta_rgb565,
+         config.grid ? "grid" : "frame", config.learning_rate > 0 ? "background" : "snapshot", frames.size());
+  printf("%-32s %8s %8s %8s %8s %8s %8s %6s %7s %7s %7s %7s\n", "frame", "full_us", "dc_us", "rgb_us", "luma_us",
+         "rgb_diff", "luma_dif", "cells", "dc_err", "rgb_mot", "full_mot", "motion");
+
+  long total_full_us = 0;
+  long total_dc_us = 0;
+  long total_rgb565_us = 0;
+  long total_scalar_us = 0;
+  long total_luma_us = 0;
+  double total_dc_err = 0;
+  int max_dc_err = 0;
+  int decoded = 0;
+  int dc_fallbacks = 0;
+  int triggers = 0;
+  int rgb565_triggers = 0;
+  int full_triggers = 0;
+  int agreements = 0;
+  int full_agreements = 0;
+  int kernel_mismatches = 0;
+  // the benchmark keeps its own references so every detector evolves as it would on the device
+  std::vector<uint8_t> rgb565_old(FRAME_ARR_LEN, 0);
+  std::vector<uint8_t> full_luma(MOTION_LUMA_LEN, 0);
+  mirror_reference full_reference;
+  int lighting_changes = 0;
+  int crops = 0;
+  int crop_failures = 0;
+  int crop_mismatches = 0;
+  long total_crop_us = 0;
+  double total_crop_share = 0;
+  std::vector<uint8_t> crop;
+  int scored = 0;
+  int score_failures = 0;
+  int blur_failures = 0;
+  long total_score_us = 0;
+  long max_score_us = 0;
+  int bursts = 0;
+  int burst_frame = 0;
+  float best_score = 0;
+  std::string best_name;
+
+  for (const std::string &path : frames) {
+    std::string name = path.substr(path.rfind('/') + 1);
+    camera_fb_t fb;
+    if (!load_frame(path, jpg, &fb)) {
+      fprintf(stderr, "failed to read %s\n", path.c_str());
+      continue;
+    }
+
+    // full decode first, for the RGB565 detector and the reference thumbnail
+    auto start = std::chrono::steady_clock::now();
+    bool worked = decode_motion_frame_full(&fb);
+    long full_us = elapsed_us(start);
+    if (!worked) {
+      printf("%-32s %8ld %s\n", name.c_str(), full_us, "decode failed");
+      continue;
+    }
+    memcpy(full_luma.data(), motion_frame_luma(), MOTION_LUMA_LEN);
+
+    start = std::chrono::steady_clock::now();
+    int rgb565_diffs = count_rgb565_diffs(motion_frame_rgb565(), rgb565_old.data(), FRAME_ARR_LEN, beta_rgb565);
+    long rgb565_us = elapsed_us(start);
+    bool rgb565_motion = rgb565_diffs > alpha;
+    if (rgb565_motion) {
+      memcpy(rgb565_old.data(), motion_frame_rgb565(), FRAME_ARR_LEN);
+    }
+
+    motion_result full_res = mirror_compare(config, full_luma.data(), &full_reference);
+
+    // then the path the firmware takes, waking up from deep sleep if simulated
+    if (deep_sleep) {
+      motion_save_reference();
+      motion_begin();
+      motion_restore_reference();
+    }
+    start = std::chrono::steady_clock::now();
+    decode_motion_frame(&fb);
+    long dc_us = elapsed_us(start);
+    dc_fallbacks += motion_frame_from_dc() ? 0 : 1;
+
+    const uint8_t *luma = motion_frame_luma();
+    long dc_err = 0;
+    for (int i = 0; i < MOTION_LUMA_LEN; i++) {
+      int err = abs(luma[i] - full_luma[i]);
+      dc_err += err;
+      max_dc_err = err > max_dc_err ? err : max_dc_err;
+    }
+
+    start = std::chrono::steady_clock::now();
+    int scalar_diffs = count_luma_diffs_scalar(luma, motion_reference_luma(), MOTION_LUMA_LEN, beta);
+    long scalar_us = elapsed_us(start);
+
+    start = std::chrono::steady_clock::now();
+    motion_result res = compare_motion_frame(config);
+    long luma_us = elapsed_us(start);
+    int all_cell_diffs = 0;
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+      all_cell_diffs += res.cell_diffs[i];
+    }
+    total_full_us += full_us;
+    total_dc_us += dc_us;
+    total_rgb565_us += rgb565_us;
+    total_scalar_us += scalar_us;
+    total_luma_us += luma_us;
+    total_dc_err += (double) dc_err / MOTION_LUMA_LEN;
+    decoded++;
+    triggers += res.motion ? 1 : 0;
+    lighting_changes += res.lighting_change ? 1 : 0;
+    rgb565_triggers += rgb565_motion ? 1 : 0;
+    full_triggers += full_res.motion ? 1 : 0;
+    agreements += res.motion == rgb565_motion ? 1 : 0;
+    full_agreements += res.motion == full_res.motion ? 1 : 0;
+    // with only the compact reference or after lighting normalization the firmware compares
+    // a different frame, so there is nothing to check the kernels against
+    bool normalized = res.lighting_gain != MOTION_GAIN_ONE || res.lighting_offset != 0;
+    if (!deep_sleep && !normalized) {
+      kernel_mismatches += scalar_diffs != all_cell_diffs ? 1 : 0;
+    }
+    motion_box region;
+    if (crop_padding >= 0 && res.motion
+        && motion_region(config, res, fb.width, fb.height, crop_padding, crop_min_size, &region)) {
+      jpeg_crop_rect rect = { region.x, region.y, region.width, region.height };
+      crop.resize(jpg.size() + 1024);
+      start = std::chrono::steady_clock::now();
+      size_t crop_len = jpeg_crop(jpg.data(), jpg.size(), &rect, crop.data(), crop.size());
+      long crop_us = elapsed_us(start);
+      if (crop_len == 0) {
+        crop_failures++;
+      } else {
+        crops++;
+        total_crop_us += crop_us;
+        total_crop_share += (double) crop_len / jpg.size();
+        crop_mismatches += crop_matches(jpg, crop.data(), crop_len, rect) ? 0 : 1;
+      }
+    }
+    printf("%-32s %8ld %8ld %8ld %8ld %8d %8d %6d %7.2f %7s %7s %7s\n", name.c_str(), full_us, dc_us, rgb565_us,
+           luma_us, rgb565_diffs, res.num_diffs, res.active_cells, (double) dc_err / MOTION_LUMA_LEN,
+           rgb565_motion ? "yes" : "no", full_res.motion ? "yes" : "no",
+           res.motion ? "yes" : (res.lighting_change ? "light" : "no"));
+
+    if (burst > 0) {
+      frame_score score;
+      start = std::chrono::steady_clock::now();
+      bool worked = score_frame(&fb, &score);
+      long score_us = elapsed_us(start);
+      if (!worked) {
+        score_failures++;
+      } else {
+        scored++;
+        total_score_us += score_us;
+        max_score_us = std::max(max_score_us, score_us);
+        if (best_name.empty() || score.score > best_score) {
+          best_score = score.score;
+          best_name = name;
+        }
+        printf("  score %.1f: detail %.1f bits/block, mean luma %d, clipped %.1f%%, %ld us\n", score.score,
+               score.detail, score.mean_luma, 100.0 * score.clipped, score_us);
+        blur_failures += sharper_than_blurred(jpg) ? 0 : 1;
+      }
+      if (++burst_frame == burst) {
+        printf("  burst %d picks %s\n", bursts, best_name.empty() ? "the first frame, none could be scored" : best_name.c_str());
+        best_name.clear();
+        bursts++;
+        burst_frame = 0;
+      }
+    }
+  }
+
+  if (decoded == 0) {
+    fprintf(stderr, "no frames decoded\n");
+    return 1;
+  }
+  double mean_full_us = (double) total_full_us / decoded;
+  double mean_dc_us = (double) total_dc_us / decoded;
+  double mean_rgb565_us = (double) total_rgb565_us / decoded;
+  double mean_scalar_us = (double) total_scalar_us / decoded;
+  double mean_luma_us = (double) total_luma_us / decoded;
+  printf("\nframes decoded:        %d (%d fell back to the full decoder)\n", decoded, dc_fallbacks);
+  printf("mean full decode time: %.1f us\n", mean_full_us);
+  printf("mean dc decode time:   %.1f us (%.1fx vs full)\n", mean_dc_us, mean_full_us / mean_dc_us);
+  printf("dc thumbnail error:    %.2f mean, %d max (out of %d)\n", total_dc_err / decoded, max_dc_err, MOTION_LUMA_MAX);
+  printf("mean rgb565 diff time: %.1f us\n", mean_rgb565_us);
+  printf("mean luma scalar time: %.1f us\n", mean_scalar_us);
+  printf("mean luma diff time:   %.1f us (%.1fx vs rgb565, %.1fx vs scalar luma)\n", mean_luma_us,
+         mean_rgb565_us / mean_luma_us, mean_scalar_us / mean_luma_us);
+  printf("frames/sec:            %.1f (%.1f with the full decoder)\n", 1e6 / (mean_dc_us + mean_luma_us),
+         1e6 / (mean_full_us + mean_luma_us));
+  printf("triggers:              %d (%.1f%%), full decoder %d (%.1f%%), rgb565 detector %d (%.1f%%)\n", triggers,
+         100.0 * triggers / decoded, full_triggers, 100.0 * full_triggers / decoded, rgb565_triggers,
+         100.0 * rgb565_triggers / decoded);
+  if (config.normalize_lighting) {
+    printf("lighting changes:      %d (%.1f%%)\n", lighting_changes, 100.0 * lighting_changes / decoded);
+  }
+  printf("decision agreement:    %.1f%% with the full decoder, %.1f%% with the rgb565 detector\n",
+         100.0 * full_agreements / decoded, 100.0 * agreements / decoded);
+  if (crop_padding >= 0) {
+    printf("motion crops:          %d (%d failed), mean %.1f%% of the frame bytes in %.1f us\n", crops, crop_failures,
+           crops ? 100.0 * total_crop_share / crops : 0.0, crops ? (double) total_crop_us / crops : 0.0);
+  }
+  if (burst > 0) {
+    printf("frame scores:          %d (%d failed) in %.1f us mean, %ld us max, %d bursts of %d\n", scored,
+           score_failures, scored ? (double) total_score_us / scored : 0.0, max_score_us, bursts, burst);
+  }
+  int static_trigger = read_file(frames[0], jpg) ? static_change_trigger_frame(jpg, debounce) : 0;
+  if (static_trigger > 0) {
+    printf("static change:         triggered on frame %d with debounce %d\n", static_trigger, debounce);
+  }
+  if (static_trigger != debounce) {
+    printf("ERROR: a change that stayed in view for %d frames %s\n", debounce + 2,
+           static_trigger < 0 ? "triggered more than once" : "didn't trigger on its debounce frame");
+    return 1;
+  }
+  if (blur_failures > 0) {
+    printf("ERROR: %d frames didn't outscore a blurred copy of themselves\n", blur_failures);
+    return 1;
+  }
+  if (crop_mismatches > 0) {
+    printf("ERROR: %d crops differ from the full frame\n", crop_mismatches);
+    return 1;
+  }
+  if (kernel_mismatches > 0) {
+    printf("ERROR: vector kernel disagreed with the scalar kernel on %d frames\n", kernel_mismatches);
+    return 1;
+  }
+  return 0;
+}
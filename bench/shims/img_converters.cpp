@@ -0,0 +1,57 @@
+#include "img_converters.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+struct shim_error_mgr
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf escape;
+};
+
+static void shim_error_exit(j_common_ptr cinfo)
+{
+  shim_error_mgr *err = (shim_error_mgr *) cinfo->err;
+  longjmp(err->escape, 1);
+}
+
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t *out, jpg_scale_t scale)
+{
+  struct jpeg_decompress_struct cinfo;
+  shim_error_mgr err;
+
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = shim_error_exit;
+  if (setjmp(err.escape)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *) src, src_len);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1 << scale;
+  jpeg_start_decompress(&cinfo);
+
+  // the row buffer belongs to the decompressor, so an error exit frees it too
+  JSAMPARRAY row = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1);
+  size_t o = 0;
+  while (cinfo.output_scanline < cinfo.output_height) {
+    jpeg_read_scanlines(&cinfo, row, 1);
+    for (JDIMENSION x = 0; x < cinfo.output_width; x++) {
+      uint8_t r = row[0][x * 3];
+      uint8_t g = row[0][x * 3 + 1];
+      uint8_t b = row[0][x * 3 + 2];
+      uint16_t c = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+      out[o++] = c >> 8;
+      out[o++] = c & 0xFF;
+    }
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
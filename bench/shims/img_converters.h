@@ -0,0 +1,20 @@
+// Host shim of the esp32-camera image converters, used by the native benchmark build
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_camera.h"
+
+typedef enum {
+  JPG_SCALE_NONE,
+  JPG_SCALE_2X,
+  JPG_SCALE_4X,
+  JPG_SCALE_8X,
+  JPG_SCALE_MAX = JPG_SCALE_8X
+} jpg_scale_t;
+
+// Decodes a JPEG into big-endian RGB565, downscaled by 2^scale, like the on-device converter.
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t *out, jpg_scale_t scale);
@@ -3,144 +3,283 @@
 #include "WiFi.h"
 #include "WiFiClientSecure.h"
 #include "HTTPClient.h"
+#include "lwip/sockets.h"
+#include "http_response.h"
+#include "upload_tuner.h"
+
+// Room for a response body. The detector list is parsed into a document of DET_DOC_SIZE, so a
+// longer response couldn't be used anyway.
+#ifndef GROUNDLIGHT_RESPONSE_SIZE
+  #define GROUNDLIGHT_RESPONSE_SIZE 16384
+#endif
 
-// Collects an HTTP response using an Arduino-compatible implementation
-String collectHttpResponse(WiFiClient &client)
+// Waits up to ms for data on the socket. Without a socket to wait on, such as for a
+// WiFiClientSecure passed as its WiFiClient base, it waits a tick instead.
+static void wait_readable(int fd, unsigned long ms)
 {
-  int timeoutDuration = 20000;
-  long startTime = millis();
-  bool isBodyReceived = false;
-  String responseBody;
-  String responseLine;
-
-  // Keep reading until timeout or a valid response body is received
-  while ((startTime + timeoutDuration) > millis())
-  {
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    while (client.available())
-    {
-      char receivedChar = client.read();
+  if (fd < 0) {
+    vTaskDelay(1);
+    return;
+  }
+  fd_set readable;
+  FD_ZERO(&readable);
+  FD_SET(fd, &readable);
+  struct timeval timeout = { (long) (ms / 1000), (long) (ms % 1000) * 1000 };
+  select(fd + 1, &readable, NULL, NULL, &timeout);
+}
 
-      // Check for a new line in the response
-      if (receivedChar == '\n')
-      {
-        if (responseLine.length() == 0)
-        {
-          isBodyReceived = true;
-        }
-        responseLine = "";
-      }
-      else if (receivedChar != '\r')
-      {
-        responseLine += String(receivedChar);
+// Reads one response from client into r, which the caller has initialized with its buffer.
+// Data TLS has already decrypted doesn't show on the socket, so the client is asked first and
+// the socket only waited on when it has nothing. Sets *closed_early, if given, when the
+// connection closed before any of the response arrived, as opposed to timing out.
+static http_response_result read_http_response(WiFiClient &client, int fd, http_response *r, unsigned long timeout_ms,
+                                               bool *closed_early = NULL)
+{
+  uint8_t buf[512];
+  size_t received = 0;
+  unsigned long start = millis();
+  while (millis() - start < timeout_ms) {
+    int n = client.available() ? client.read(buf, sizeof(buf)) : 0;
+    if (n > 0) {
+      received += n;
+      size_t used;
+      http_response_result result = http_response_feed(r, buf, n, &used);
+      if (result != HTTP_RESPONSE_MORE) {
+        // nothing is pipelined, so anything after the response means the connection is out of step
+        r->keep_alive = r->keep_alive && used == (size_t) n;
+        return result;
       }
-
-      // Append the received character to the response body if needed
-      if (isBodyReceived)
-      {
-        responseBody += String(receivedChar);
+    } else if (!client.connected()) {
+      if (closed_early) {
+        *closed_early = received == 0;
       }
-      startTime = millis();
+      return http_response_end(r);
+    } else {
+      wait_readable(fd, min(timeout_ms - (millis() - start), 100UL));
     }
+  }
+  return HTTP_RESPONSE_ERROR;
+}
 
-    if (responseBody.length() > 0)
-    {
-      break;
+// Requests are written from here: the headers are formatted into it and sent together with the
+// start of the body, so a request without a body is a single write and an upload's first TLS
+// record is a full one. Allocated with the first request and kept, and like the rest of the
+// library not meant for two tasks at once.
+static char *request_buffer = NULL;
+static upload_tuner write_tuner;
+
+// The buffer of UPLOAD_SEGMENT_MAX bytes to format request headers into, or NULL if there is no
+// memory for it
+static char *get_request_buffer()
+{
+  if (!request_buffer) {
+    request_buffer = (char *) malloc(UPLOAD_SEGMENT_MAX);
+    upload_tuner_init(&write_tuner);
+  }
+  return request_buffer;
+}
+
+static bool write_fully(WiFiClient &client, const uint8_t *data, size_t len, size_t segment)
+{
+  for (size_t sent = 0; sent < len;) {
+    size_t written = client.write(data + sent, min(len - sent, segment));
+    if (written == 0) {
+      return false;
     }
+    sent += written;
   }
+  return true;
+}
 
-  return responseBody;
+// Writes a request whose headers_len bytes of headers are in request_buffer, and then body. The
+// body fills the rest of the first write after the headers and is then written straight from
+// where it is, in writes of the size the tuner picked from the throughput of earlier uploads.
+// Sets *write_size to that size.
+static bool write_request(WiFiClient &client, size_t headers_len, const uint8_t *body, size_t body_len, size_t *write_size)
+{
+  size_t segment = upload_tuner_segment_size(&write_tuner);
+  size_t first = headers_len < segment ? min(body_len, segment - headers_len) : 0;
+  if (first > 0) {
+    memcpy(request_buffer + headers_len, body, first);
+  }
+  unsigned long start = millis();
+  if (!write_fully(client, (const uint8_t *) request_buffer, headers_len + first, segment)
+      || !write_fully(client, body + first, body_len - first, segment)) {
+    return false;
+  }
+  upload_tuner_record(&write_tuner, body_len, millis() - start);
+  *write_size = segment;
+  return true;
 }
 
-#ifdef HAS_ESP_CAMERA_LIB
-String submit_image_query(camera_fb_t *image_bytes, char *endpoint, char *detector_id, char *api_token)
+// The endpoint's address, set by the caller or learned from the last lookup
+static char endpoint_host[64] = "";
+static IPAddress endpoint_address;
+
+void set_endpoint_address(const char *endpoint, IPAddress address)
+{
+  strncpy(endpoint_host, endpoint, sizeof(endpoint_host) - 1);
+  endpoint_address = address;
+}
+
+IPAddress get_endpoint_address(const char *endpoint)
+{
+  return strcmp(endpoint, endpoint_host) == 0 ? endpoint_address : IPAddress();
+}
+
+// Looks the endpoint's host up and remembers its address. Right after a connection by name
+// this is answered from the lwIP cache.
+static void learn_endpoint_address(const char *endpoint, const char *host)
+{
+  IPAddress address;
+  if (WiFi.hostByName(host, address) == 1) {
+    set_endpoint_address(endpoint, address);
+  }
+}
+
+// Splits an endpoint setting such as "api.groundlight.ai", "https://host" or "http://host:8080"
+static void parse_endpoint(const char *endpoint, String &host, int &port, bool &https)
 {
-  bool isHTTPS = true;
-  String _endpoint = endpoint;
-  int port = 443;
+  host = endpoint;
+  port = 443;
+  https = true;
+
+  if (host.indexOf("http://") != -1) {
+    https = false;
+    host = host.substring(host.indexOf("//") + 2);
+  } else if (host.indexOf("https://") != -1) {
+    host = host.substring(host.indexOf("//") + 2);
+  }
 
-  if (_endpoint.indexOf("http://") != -1) {
-    isHTTPS = false;
-    _endpoint = _endpoint.substring(_endpoint.indexOf("//") + 2);
-  } else if (_endpoint.indexOf("https://") != -1) {
-    _endpoint = _endpoint.substring(_endpoint.indexOf("//") + 2);
+  if (host.indexOf(":") != -1) {
+    port = host.substring(host.indexOf(":") + 1).toInt();
+    host = host.substring(0, host.indexOf(":"));
   }
+}
+
+String get_endpoint_host(const char *endpoint)
+{
+  String host;
+  int port;
+  bool https;
+  parse_endpoint(endpoint, host, port, https);
+  return host;
+}
 
-  if (_endpoint.indexOf(":") != -1) {
-    port = _endpoint.substring(_endpoint.indexOf(":") + 1).toInt();
-    _endpoint = _endpoint.substring(0, _endpoint.indexOf(":"));
+// Connects to the endpoint by its known address when there is one, which skips the DNS lookup,
+// and by name otherwise or when the address doesn't answer. The connection by address is made
+// here, where the client type is known, since TLS still needs the name for SNI.
+static bool connect_endpoint(WiFiClient &client, ResumableClientSecure *secure, const char *endpoint, const String &host, int port)
+{
+  IPAddress address = get_endpoint_address(endpoint);
+  if ((uint32_t) address != 0) {
+    bool connected = secure ? secure->connect(address, port, host.c_str()) : client.connect(address, port);
+    if (connected) {
+      return true;
+    }
+    set_endpoint_address(endpoint, IPAddress());
+  }
+  if (!client.connect(host.c_str(), port)) {
+    return false;
   }
+  learn_endpoint_address(endpoint, host.c_str());
+  return true;
+}
 
-  if (isHTTPS) {
-    WiFiClientSecure client;
+#ifdef HAS_ESP_CAMERA_LIB
+#define INITIAL_CONNECTION_FAILURE "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"INITIAL_SSL_CONNECTION_FAILURE\" } }"
+
+static upload_stats last_upload_stats = { 0 };
+static unsigned long address_connect_ms = 0;
+
+upload_stats get_last_upload_stats()
+{
+  return last_upload_stats;
+}
+
+String submit_image_query(camera_fb_t *image_bytes, char *endpoint, char *detector_id, char *api_token)
+{
+  String host;
+  int port;
+  bool https;
+  parse_endpoint(endpoint, host, port, https);
+
+  String response;
+  unsigned long start = millis();
+  if (https) {
+    ResumableClientSecure client;
     client.setInsecure();
-    return submit_image_query_with_client(image_bytes, _endpoint.c_str(), detector_id, api_token, client, port);
+    if (!connect_endpoint(client, &client, endpoint, host, port)) {
+      last_upload_stats = { 0 };
+      return INITIAL_CONNECTION_FAILURE;
+    }
+    address_connect_ms = millis() - start;
+    response = submit_image_query_with_client(image_bytes, host.c_str(), detector_id, api_token, client, port);
   } else {
     WiFiClient client;
-    return submit_image_query_with_client(image_bytes, _endpoint.c_str(), detector_id, api_token, client, port);
+    if (!connect_endpoint(client, NULL, endpoint, host, port)) {
+      last_upload_stats = { 0 };
+      return INITIAL_CONNECTION_FAILURE;
+    }
+    address_connect_ms = millis() - start;
+    response = submit_image_query_with_client(image_bytes, host.c_str(), detector_id, api_token, client, port);
   }
+  return response;
 }
 
 String submit_image_query_with_client(camera_fb_t *image_bytes, const char *endpoint, char *detector_id, char *api_token, WiFiClient &client, int port)
 {
   String responseBody;
 
-  if (!client.connect(endpoint, port)) {
-    return "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"INITIAL_SSL_CONNECTION_FAILURE\" } }";
+  last_upload_stats = { 0 };
+  // submit_image_query hands over a client it already connected
+  unsigned long start = millis() - address_connect_ms;
+  address_connect_ms = 0;
+  if (!client.connected() && !client.connect(endpoint, port)) {
+    return INITIAL_CONNECTION_FAILURE;
   }
   client.setTimeout(120);
-
-  char requestTarget[256] = "POST /device-api/v1/image-queries?detector_id=";
-  strcat(requestTarget, detector_id);
-  strcat(requestTarget, " HTTP/1.1");
-
-  // Serial.printf("attempting image query with [HTTPS] %s\n", requestTarget);
-  client.println(requestTarget);
-  client.print("Host: ");
-  client.println(endpoint);
-  client.print("Content-Length: ");
-  client.println(image_bytes->len);
-  client.println("Content-Type: image/jpeg");
-  client.print("X-API-Token: ");
-  client.println(api_token);
-  client.print("\r\n");
-
-  if (!client.connected())
+  unsigned long connected = millis();
+
+  char *request = get_request_buffer();
+  int headers_len = request ? snprintf(request, UPLOAD_SEGMENT_MAX,
+                                       "POST /device-api/v1/image-queries?detector_id=%s HTTP/1.1\r\n"
+                                       "Host: %s\r\n"
+                                       "Content-Length: %u\r\n"
+                                       "Content-Type: image/jpeg\r\n"
+                                       "X-API-Token: %s\r\n"
+                                       "\r\n",
+                                       detector_id, endpoint, (unsigned) image_bytes->len, api_token) : 0;
+  size_t image_size = image_bytes->len;
+  size_t write_size = 0;
+  if (headers_len <= 0 || headers_len >= UPLOAD_SEGMENT_MAX
+      || !write_request(client, headers_len, image_bytes->buf, image_size, &write_size))
   {
     // Serial.println("SSL appears to be dead. returning QUERY_FAIL");
+    client.stop();
     return "{ \"result\" : { \"confidence\" : 0.0, \"label\" : \"QUERY_FAIL\", \"failure_reason\": \"SSL_CONNECTION_FAILURE\" } }";
   }
-
-  uint8_t *image = image_bytes->buf;
-  size_t image_size = image_bytes->len;
-  int chunk_size = 1024;
-
-  // Serial.printf("Writing %d byte image in %d-byte chunks", image_size, chunk_size);
-
-  for (size_t n = 0; n < image_size; n += chunk_size)
-  {
-    if (n + chunk_size < image_size)
-    {
-      client.write(image, chunk_size);
-      // Serial.print(".");
-      image += chunk_size;
-    }
-    else if (image_size % chunk_size > 0)
-    {
-      size_t rem = image_size % chunk_size;
-      client.write(image, rem);
-      // Serial.printf(".");
-    }
-  }
-  // Serial.println("done!");
-
-  client.print("\r\n");
+  unsigned long written = millis();
 
   if (client.connected())
   {
     // Serial.print("collecting response...");
-    String responseBody = collectHttpResponse(client);
+    char *body = (char *) malloc(GROUNDLIGHT_RESPONSE_SIZE);
+    if (!body) {
+      client.stop();
+      return "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"SSL_CONNECTION_FAILURE_COLLECTING_RESPONSE\" } }";
+    }
+    http_response response;
+    http_response_init(&response, body, GROUNDLIGHT_RESPONSE_SIZE);
+    http_response_result result = read_http_response(client, client.fd(), &response, 20000);
+    String responseBody = result == HTTP_RESPONSE_DONE ? body : "";
+    free(body);
     client.stop();
+    last_upload_stats.bytes = image_size;
+    last_upload_stats.write_size = write_size;
+    last_upload_stats.connect_ms = connected - start;
+    last_upload_stats.write_ms = written - connected;
+    last_upload_stats.response_ms = millis() - written;
     if (responseBody.indexOf("Not authenticated.") != -1) {
       return "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"NOT_AUTHENTICATED\" } }";
     }
@@ -158,7 +297,7 @@ String get_image_query(char *endpoint, const char *query_id, char *api_token) {
   String url = "https://" + String(endpoint) + "/device-api/v1/image-queries/" + String(query_id);
   String response = "NONE";
 
-  WiFiClientSecure *client = new WiFiClientSecure;
+  WiFiClientSecure *client = new ResumableClientSecure;
 
   // Serial.print("Checking for image query results...");
 
@@ -219,7 +358,7 @@ bool adjust_confidence(const char *endpoint, const char *predictorId, float conf
   // requestData["confidence_threshold"] = confidence;
 
   // Initialize WiFiClientSecure and HTTPClient.
-  WiFiClientSecure *client = new WiFiClientSecure;
+  WiFiClientSecure *client = new ResumableClientSecure;
   HTTPClient https;
 
   if (client)
@@ -286,7 +425,7 @@ String get_detectors(const char *endpoint, const char *apiToken) {
   String url = "https://" + String(endpoint) + "/device-api/v1/detectors";
   String response = "NONE";
 
-  WiFiClientSecure *client = new WiFiClientSecure;
+  WiFiClientSecure *client = new ResumableClientSecure;
 
   if (client)
   {
@@ -329,6 +468,237 @@ String get_detectors(const char *endpoint, const char *apiToken) {
   return response;
 }
 
+// How long GroundlightClient waits for a response before giving up on the connection
+#define CLIENT_RESPONSE_TIMEOUT_MS 20000
+
+// GroundlightClient::request results other than a status code
+#define CLIENT_CONNECT_FAILED -1    // couldn't connect
+#define CLIENT_SEND_FAILED -2       // the connection dropped while sending the request
+#define CLIENT_NO_RESPONSE -3       // the server closed the connection without sending anything
+#define CLIENT_BAD_RESPONSE -4      // the response was malformed or cut short
+#define CLIENT_RESPONSE_TIMEOUT -5  // no response in time, though the server may have handled the request
+
+GroundlightClient::GroundlightClient(unsigned long idle_timeout_ms)
+  : client(NULL), response_body(NULL), port(443), https(true), idle_timeout_ms(idle_timeout_ms), last_used(0),
+    connect_ms(0), write_size(0), write_ms(0), response_ms(0), connection_count(0), request_count(0)
+{
+  endpoint[0] = '\0';
+  api_token[0] = '\0';
+}
+
+GroundlightClient::~GroundlightClient()
+{
+  stop();
+  free(response_body);
+}
+
+void GroundlightClient::begin(const char *endpoint, const char *api_token)
+{
+  if (strcmp(endpoint, this->endpoint) != 0) {
+    stop();
+    strlcpy(this->endpoint, endpoint, sizeof(this->endpoint));
+    parse_endpoint(endpoint, host, port, https);
+  }
+  strlcpy(this->api_token, api_token, sizeof(this->api_token));
+}
+
+bool GroundlightClient::connect()
+{
+  if (is_open()) {
+    return true;
+  }
+  stop();
+  ResumableClientSecure *secure = NULL;
+  if (https) {
+    secure = new ResumableClientSecure;
+    secure->setInsecure();
+    client = secure;
+  } else {
+    client = new WiFiClient;
+  }
+  unsigned long start = millis();
+  if (!connect_endpoint(*client, secure, endpoint, host, port)) {
+    stop();
+    return false;
+  }
+  connect_ms = millis() - start;
+  connection_count++;
+  last_used = millis();
+  return true;
+}
+
+void GroundlightClient::stop()
+{
+  if (client) {
+    client->stop();
+    delete client;
+    client = NULL;
+  }
+}
+
+// Whether the connection can take a request. Servers close connections that sit idle, so one
+// idle for too long is closed here rather than risking a request on it.
+bool GroundlightClient::is_open()
+{
+  if (!client) {
+    return false;
+  }
+  if (!client->connected() || millis() - last_used > idle_timeout_ms) {
+    stop();
+    return false;
+  }
+  return true;
+}
+
+// Sends one request, connecting first if needed, and returns the status code of the response,
+// or one of the CLIENT_ errors. A reused connection the server has closed in the meantime only
+// shows when sending fails or the server closes it without a response, so those cases are sent
+// again once on a new connection. A request that timed out isn't, since the server may have
+// handled it and an image query would be submitted twice. The response is waited for wait_s
+// longer than usual.
+int GroundlightClient::request(const char *method, const String &path, const char *content_type,
+                               const uint8_t *body, size_t body_len, String &response, int wait_s)
+{
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = is_open();
+    connect_ms = 0;
+    if (!reused && !connect()) {
+      return CLIENT_CONNECT_FAILED;
+    }
+    bool keep_alive = false;
+    int status = send_request(method, path, content_type, body, body_len, response, keep_alive, wait_s);
+    if (status > 0) {
+      request_count++;
+      if (keep_alive) {
+        last_used = millis();
+      } else {
+        stop();
+      }
+      return status;
+    }
+    stop();
+    if (!reused || (status != CLIENT_SEND_FAILED && status != CLIENT_NO_RESPONSE)) {
+      return status;
+    }
+  }
+  return CLIENT_NO_RESPONSE;
+}
+
+int GroundlightClient::send_request(const char *method, const String &path, const char *content_type,
+                                    const uint8_t *body, size_t body_len, String &response, bool &keep_alive, int wait_s)
+{
+  if (!response_body) {
+    response_body = (char *) malloc(GROUNDLIGHT_RESPONSE_SIZE);
+    if (!response_body) {
+      return CLIENT_BAD_RESPONSE;
+    }
+  }
+  char *request = get_request_buffer();
+  if (!request) {
+    return CLIENT_BAD_RESPONSE;
+  }
+  unsigned long start = millis();
+  int headers_len = snprintf(request, UPLOAD_SEGMENT_MAX,
+                             "%s %s HTTP/1.1\r\n"
+                             "Host: %s\r\n"
+                             "X-API-Token: %s\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %u\r\n"
+                             "Connection: keep-alive\r\n"
+                             "\r\n",
+                             method, path.c_str(), host.c_str(), api_token, content_type, (unsigned) body_len);
+  if (headers_len <= 0 || headers_len >= UPLOAD_SEGMENT_MAX) {
+    return CLIENT_BAD_RESPONSE;
+  }
+  // a WiFiClientSecure's socket is only reachable through its own fd()
+  int socket = https ? static_cast<WiFiClientSecure *>(client)->fd() : client->fd();
+  if (!write_request(*client, headers_len, body, body_len, &write_size)) {
+    return CLIENT_SEND_FAILED;
+  }
+  unsigned long sent = millis();
+  write_ms = sent - start;
+
+  http_response parsed;
+  http_response_init(&parsed, response_body, GROUNDLIGHT_RESPONSE_SIZE);
+  bool closed_early = false;
+  http_response_result result = read_http_response(*client, socket, &parsed, CLIENT_RESPONSE_TIMEOUT_MS + wait_s * 1000UL,
+                                                   &closed_early);
+  response_ms = millis() - sent;
+  if (result != HTTP_RESPONSE_DONE) {
+    if (closed_early) {
+      return CLIENT_NO_RESPONSE;
+    }
+    return parsed.status == 0 && client->connected() ? CLIENT_RESPONSE_TIMEOUT : CLIENT_BAD_RESPONSE;
+  }
+  if (parsed.truncated) {
+    return CLIENT_BAD_RESPONSE;
+  }
+  response = response_body;
+  keep_alive = parsed.keep_alive;
+  return parsed.status;
+}
+
+#ifdef HAS_ESP_CAMERA_LIB
+String GroundlightClient::submit_image_query(camera_fb_t *image_bytes, const char *detector_id, int wait_s)
+{
+  last_upload_stats = { 0 };
+  String response;
+  String path = String("/device-api/v1/image-queries?detector_id=") + detector_id;
+  if (wait_s > 0) {
+    path += "&wait=";
+    path += String(wait_s);
+  }
+  int status = request("POST", path, "image/jpeg", image_bytes->buf, image_bytes->len, response, wait_s);
+  if (status == CLIENT_CONNECT_FAILED) {
+    return INITIAL_CONNECTION_FAILURE;
+  } else if (status == CLIENT_SEND_FAILED) {
+    return "{ \"result\" : { \"confidence\" : 0.0, \"label\" : \"QUERY_FAIL\", \"failure_reason\": \"SSL_CONNECTION_FAILURE\" } }";
+  } else if (status < 0) {
+    return "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"SSL_CONNECTION_FAILURE_COLLECTING_RESPONSE\" } }";
+  }
+  last_upload_stats.bytes = image_bytes->len;
+  last_upload_stats.write_size = write_size;
+  last_upload_stats.connect_ms = connect_ms;
+  last_upload_stats.write_ms = write_ms;
+  last_upload_stats.response_ms = response_ms;
+  if (response.indexOf("Not authenticated.") != -1) {
+    return "{ \"result\": { \"confidence\": 0.0, \"label\": \"QUERY_FAIL\", \"failure_reason\": \"NOT_AUTHENTICATED\" } }";
+  }
+  return response;
+}
+#endif
+
+String GroundlightClient::get_image_query(const char *query_id, int wait_s)
+{
+  String response;
+  String path = String("/device-api/v1/image-queries/") + query_id;
+  if (wait_s > 0) {
+    path += "?wait=";
+    path += String(wait_s);
+  }
+  if (request("GET", path, "application/json", NULL, 0, response, wait_s) < 0) {
+    return "NONE";
+  }
+  return response;
+}
+
+String GroundlightClient::get_detectors()
+{
+  String response;
+  if (request("GET", "/device-api/v1/detectors", "application/json", NULL, 0, response) < 0) {
+    return "NONE";
+  }
+  return response;
+}
+
+bool GroundlightClient::adjust_confidence(const char *predictor_id, float confidence)
+{
+  String body = "{ \"confidence_threshold\" : " + String(confidence) + " }";
+  String response;
+  return request("PATCH", String("/device-api/predictors/") + predictor_id, "application/json",
+                 (const uint8_t *) body.c_str(), body.length(), response) > 0;
+}
+
 #ifdef HAS_JSON_LIB
 
 #ifndef DET_DOC_SIZE
@@ -365,6 +735,22 @@ String get_query_id(const String &jsonResults) {
   return results["id"];
 }
 
+float get_query_confidence_threshold(const String &jsonResults) {
+  DynamicJsonDocument results(1024);
+  if (deserializeJson(results, jsonResults) != ArduinoJson::DeserializationError::Ok) {
+    return 0.0;
+  }
+  return results["confidence_threshold"] | 0.0;
+}
+
+bool get_query_done(const String &jsonResults) {
+  DynamicJsonDocument results(1024);
+  if (deserializeJson(results, jsonResults) != ArduinoJson::DeserializationError::Ok) {
+    return false;
+  }
+  return results["done_processing"] | false;
+}
+
 StaticJsonDocument<DET_DOC_SIZE> groundlight_json_doc;
 
 detector_list get_detector_list(const char *endpoint, const char *apiToken) {
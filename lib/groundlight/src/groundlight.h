@@ -5,6 +5,7 @@
 
 #include "Arduino.h"
 #include "WiFiClient.h"
+#include "tls_session.h"
 
 #if __has_include("esp_camera.h")
   #include "esp_camera.h"
@@ -19,12 +20,100 @@
 #ifdef HAS_ESP_CAMERA_LIB
   String submit_image_query(camera_fb_t *image_bytes, char *endpoint, char *detector_id, char *api_token);
   String submit_image_query_with_client(camera_fb_t *image_bytes, const char *endpoint, char *detector_id, char *api_token, WiFiClient &client, int port);
+
+  // Timings of the last image query upload, all zero if it failed to connect
+  struct upload_stats
+  {
+    size_t bytes;               // image bytes written
+    size_t write_size;          // size of the writes the image went out in
+    unsigned long connect_ms;   // connecting, including the TLS handshake
+    unsigned long write_ms;     // writing the request and the image
+    unsigned long response_ms;  // waiting for and reading the response
+  };
+
+  upload_stats get_last_upload_stats();
+
 #endif
 
+// The address submit_image_query connects to for an endpoint (as passed to it, scheme and port
+// included) instead of looking its host up, such as one kept across deep sleep. If it doesn't
+// answer it is cleared and the host is looked up again. Every lookup made to connect is
+// remembered here too.
+void set_endpoint_address(const char *endpoint, IPAddress address);
+
+// The endpoint's address as set or last looked up, or 0.0.0.0 if there is none
+IPAddress get_endpoint_address(const char *endpoint);
+
+// The host name in an endpoint setting, which TLS sessions are cached by (see tls_session.h)
+String get_endpoint_host(const char *endpoint);
+
 String get_image_query(char *endpoint, const char *query_id, char *api_token);
 bool adjust_confidence(const char *endpoint, const char *predictorId, float confidence, const char *apiToken);
 String get_detectors(const char *endpoint, const char *apiToken);
 
+// A connection to the Groundlight API kept open across requests with HTTP/1.1 keep-alive, so
+// an image query and the polls for its answer share one TLS handshake instead of making one
+// each. Requests reconnect on their own when the connection was closed by the server or has
+// been idle longer than idle_timeout_ms, and a request on a reused connection that the server
+// dropped before answering is sent again once on a new one. Not safe to use from two tasks at
+// the same time.
+class GroundlightClient
+{
+public:
+  GroundlightClient(unsigned long idle_timeout_ms = 20000);
+  ~GroundlightClient();
+
+  // Sets the endpoint and API token for the requests that follow. Changing the endpoint
+  // closes the connection.
+  void begin(const char *endpoint, const char *api_token);
+
+  // Opens the connection now if it isn't open, such as to overlap the handshake with other
+  // work, and leaves it open for the next request.
+  bool connect();
+
+  // Closes the connection. The next request opens a new one.
+  void stop();
+
+  // With wait_s, submit_image_query and get_image_query ask the server to hold the response
+  // for up to that many seconds until the answer is confident. A server that doesn't support
+  // this answers right away, which shows in last_response_ms.
+#ifdef HAS_ESP_CAMERA_LIB
+  // Same results as the submit_image_query function, with get_last_upload_stats updated too.
+  // connect_ms is 0 when the request went over an open connection.
+  String submit_image_query(camera_fb_t *image_bytes, const char *detector_id, int wait_s = 0);
+#endif
+  String get_image_query(const char *query_id, int wait_s = 0);
+  String get_detectors();
+  bool adjust_confidence(const char *predictor_id, float confidence);
+
+  int connections() const { return connection_count; }   // connections opened so far
+  int requests() const { return request_count; }         // requests answered so far
+  unsigned long last_response_ms() const { return response_ms; }  // time the last response took after sending
+
+private:
+  bool is_open();
+  int request(const char *method, const String &path, const char *content_type,
+              const uint8_t *body, size_t body_len, String &response, int wait_s = 0);
+  int send_request(const char *method, const String &path, const char *content_type,
+                   const uint8_t *body, size_t body_len, String &response, bool &keep_alive, int wait_s);
+
+  WiFiClient *client;
+  char *response_body;          // GROUNDLIGHT_RESPONSE_SIZE bytes, allocated with the first request
+  char endpoint[64];
+  char api_token[80];
+  String host;
+  int port;
+  bool https;
+  unsigned long idle_timeout_ms;
+  unsigned long last_used;
+  unsigned long connect_ms;     // time taken by the last request to connect, 0 if it reused the connection
+  size_t write_size;            // size of the writes the last request went out in
+  unsigned long write_ms;       // time taken by the last request to send
+  unsigned long response_ms;    // time taken by the last request to receive the response
+  int connection_count;
+  int request_count;
+};
+
 #ifdef HAS_JSON_LIB
 struct detector
 {
@@ -50,4 +139,8 @@ detector get_detector_by_id(const char *endpoint, const char *detectorId, const
 detector get_detector_by_name(const char *endpoint, const char *detectorName, const char *apiToken);
 float get_query_confidence(const String &jsonResults);
 String get_query_id(const String &jsonResults);
+// The confidence the detector answers at, or 0 if the results don't say
+float get_query_confidence_threshold(const String &jsonResults);
+// Whether the server is done with the image query, so its answer won't change any more
+bool get_query_done(const String &jsonResults);
 #endif
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include "tls_session.h"
+#include "WiFi.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+
+struct tls_session_entry
+{
+  char host[64];              // empty for an unused entry
+  mbedtls_ssl_session session;
+  unsigned long used_at;
+};
+
+static tls_session_entry sessions[TLS_SESSION_CACHE_SIZE];
+static tls_handshake_stats handshake_stats = { 0 };
+
+tls_handshake_stats get_tls_handshake_stats()
+{
+  return handshake_stats;
+}
+
+static tls_session_entry *find_session(const char *host)
+{
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    if (sessions[i].host[0] && strcmp(sessions[i].host, host) == 0) {
+      return &sessions[i];
+    }
+  }
+  return NULL;
+}
+
+// An empty entry for host, replacing the session it had, or the least recently used one if it
+// had none. mbedTLS only copies sessions into unused ones.
+static tls_session_entry *claim_session(const char *host)
+{
+  tls_session_entry *entry = find_session(host);
+  for (int i = 0; !entry && i < TLS_SESSION_CACHE_SIZE; i++) {
+    if (!sessions[i].host[0]) {
+      entry = &sessions[i];
+    }
+  }
+  for (int i = 0; !entry && i < TLS_SESSION_CACHE_SIZE; i++) {
+    if (i == 0 || sessions[i].used_at < entry->used_at) {
+      entry = &sessions[i];
+    }
+  }
+  if (entry->host[0]) {
+    mbedtls_ssl_session_free(&entry->session);
+  }
+  mbedtls_ssl_session_init(&entry->session);
+  strlcpy(entry->host, host, sizeof(entry->host));
+  return entry;
+}
+
+static void forget_session(tls_session_entry *entry)
+{
+  mbedtls_ssl_session_free(&entry->session);
+  entry->host[0] = '\0';
+}
+
+// Opens the TCP connection and runs the TLS handshake the way the core's start_ssl_client does
+// for setInsecure(), but offering session to the server. It's done one handshake step at a
+// time to see which way the server went: a full handshake goes on from the server hello to the
+// server's certificate, a resumed one straight to its change cipher spec. Sets handshake_ms to
+// the time taken after the TCP connection, which resuming doesn't change.
+static int start_resumable_ssl(sslclient_context *ssl, IPAddress ip, uint16_t port, const char *host, int timeout_ms,
+                               const mbedtls_ssl_session *session, bool *resumed, unsigned long *handshake_ms)
+{
+  ssl->socket = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (ssl->socket < 0) {
+    return -1;
+  }
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = (uint32_t) ip;
+  address.sin_port = htons(port);
+
+  fcntl(ssl->socket, F_SETFL, fcntl(ssl->socket, F_GETFL, 0) | O_NONBLOCK);
+  if (lwip_connect(ssl->socket, (struct sockaddr *) &address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+    return -1;
+  }
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(ssl->socket, &writable);
+  struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+  if (select(ssl->socket + 1, NULL, &writable, NULL, &timeout) <= 0) {
+    return -1;
+  }
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(ssl->socket, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+    return -1;
+  }
+  int enable = 1;
+  setsockopt(ssl->socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  setsockopt(ssl->socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  unsigned long start = millis();
+
+  const char *personalization = "esp32-tls";
+  mbedtls_entropy_init(&ssl->entropy_ctx);
+  int ret = mbedtls_ctr_drbg_seed(&ssl->drbg_ctx, mbedtls_entropy_func, &ssl->entropy_ctx,
+                                  (const unsigned char *) personalization, strlen(personalization));
+  if (ret != 0) {
+    return ret;
+  }
+  ret = mbedtls_ssl_config_defaults(&ssl->ssl_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret != 0) {
+    return ret;
+  }
+  mbedtls_ssl_conf_authmode(&ssl->ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+  mbedtls_ssl_conf_rng(&ssl->ssl_conf, mbedtls_ctr_drbg_random, &ssl->drbg_ctx);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+  mbedtls_ssl_conf_session_tickets(&ssl->ssl_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  if ((ret = mbedtls_ssl_setup(&ssl->ssl_ctx, &ssl->ssl_conf)) != 0
+      || (ret = mbedtls_ssl_set_hostname(&ssl->ssl_ctx, host)) != 0) {
+    return ret;
+  }
+  if (session && mbedtls_ssl_set_session(&ssl->ssl_ctx, session) != 0) {
+    session = NULL;
+  }
+  mbedtls_ssl_set_bio(&ssl->ssl_ctx, &ssl->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+  bool certificate = false;
+  while (ssl->ssl_ctx.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+    ret = mbedtls_ssl_handshake_step(&ssl->ssl_ctx);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      if (millis() - start > ssl->handshake_timeout) {
+        return -1;
+      }
+      vTaskDelay(1);
+      continue;
+    }
+    if (ret != 0) {
+      return ret;
+    }
+    certificate = certificate || ssl->ssl_ctx.state == MBEDTLS_SSL_SERVER_CERTIFICATE;
+  }
+  *resumed = session && !certificate;
+  *handshake_ms = millis() - start;
+  return ssl->socket;
+}
+
+int ResumableClientSecure::connect(IPAddress ip, uint16_t port, const char *host)
+{
+  if (!_use_insecure || !host) {
+    return WiFiClientSecure::connect(ip, port, host, _CA_cert, _cert, _private_key);
+  }
+  tls_session_entry *entry = find_session(host);
+  bool resumed = false;
+  unsigned long took = 0;
+  int ret = start_resumable_ssl(sslclient, ip, port, host, _timeout > 0 ? _timeout : 30000,
+                                entry ? &entry->session : NULL, &resumed, &took);
+  _lastError = ret < 0 ? ret : 0;
+  if (ret < 0) {
+    // the session may be what the server didn't like
+    if (entry) {
+      forget_session(entry);
+    }
+    stop();
+    return 0;
+  }
+  _connected = true;
+
+  handshake_stats.last_ms = took;
+  handshake_stats.last_resumed = resumed;
+  if (resumed) {
+    handshake_stats.resumed++;
+    handshake_stats.resumed_ms += took;
+  } else {
+    handshake_stats.full++;
+    handshake_stats.full_ms += took;
+  }
+  entry = claim_session(host);
+  if (mbedtls_ssl_get_session(&sslclient->ssl_ctx, &entry->session) != 0) {
+    forget_session(entry);
+  } else {
+    entry->used_at = millis();
+  }
+  return 1;
+}
+
+int ResumableClientSecure::connect(const char *host, uint16_t port)
+{
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip)) {
+    return 0;
+  }
+  return connect(ip, port, host);
+}
+
+int ResumableClientSecure::connect(const char *host, uint16_t port, int32_t timeout)
+{
+  _timeout = timeout;
+  return connect(host, port);
+}
+
+size_t save_tls_session(const char *host, uint8_t *buf, size_t size)
+{
+  tls_session_entry *entry = find_session(host);
+  size_t len = 0;
+  if (!entry || mbedtls_ssl_session_save(&entry->session, buf, size, &len) != 0) {
+    return 0;
+  }
+  return len;
+}
+
+bool load_tls_session(const char *host, const uint8_t *buf, size_t len)
+{
+  tls_session_entry *entry = claim_session(host);
+  if (mbedtls_ssl_session_load(&entry->session, buf, len) != 0) {
+    forget_session(entry);
+    return false;
+  }
+  entry->used_at = millis();
+  return true;
+}
@@ -0,0 +1,47 @@
+// TLS session resumption for WiFiClientSecure
+// MIT License
+
+#pragma once
+
+#include "Arduino.h"
+#include "WiFiClientSecure.h"
+
+// Hosts whose last session is kept for resuming
+#define TLS_SESSION_CACHE_SIZE 4
+
+// A WiFiClientSecure that offers the server the session of its last connection to the same
+// host, cached by host name, so a server that still knows it skips the certificate exchange
+// and key agreement for an abbreviated handshake. A server that doesn't falls back to a full
+// handshake in the same connection, and a handshake that fails drops the cached session.
+//
+// Sessions are only resumed for setInsecure() connections made by host name, which is every
+// connection the firmware makes. Anything else connects like a WiFiClientSecure. Like the
+// clients using it, the cache isn't safe to use from two tasks at the same time.
+class ResumableClientSecure : public WiFiClientSecure
+{
+public:
+  using WiFiClientSecure::connect;
+  int connect(IPAddress ip, uint16_t port, const char *host);
+  int connect(const char *host, uint16_t port);
+  int connect(const char *host, uint16_t port, int32_t timeout);
+};
+
+// Handshakes made by ResumableClientSecure since boot
+struct tls_handshake_stats
+{
+  int full;                   // full handshakes, including offered sessions the server didn't resume
+  int resumed;                // abbreviated handshakes
+  unsigned long full_ms;      // total handshake time of each kind, after the TCP connection
+  unsigned long resumed_ms;
+  unsigned long last_ms;
+  bool last_resumed;
+};
+
+tls_handshake_stats get_tls_handshake_stats();
+
+// Serializes the session cached for host into buf, such as to keep it in RTC memory through
+// deep sleep, and returns its length, or 0 if there is none or it doesn't fit.
+size_t save_tls_session(const char *host, uint8_t *buf, size_t size);
+
+// Caches a session serialized by save_tls_session for the next connection to host
+bool load_tls_session(const char *host, const uint8_t *buf, size_t len);
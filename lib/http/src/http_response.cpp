@@ -0,0 +1,221 @@
+#include "http_response.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+enum parser_state
+{
+  STATUS_LINE,
+  HEADER_LINE,
+  BODY,                 // Content-Length bytes
+  BODY_UNTIL_CLOSE,
+  CHUNK_SIZE_LINE,
+  CHUNK_DATA,
+  CHUNK_END_LINE,       // the CRLF after a chunk's data
+  TRAILER_LINE,
+  DONE,
+  FAILED,
+};
+
+void http_response_init(http_response *r, char *body, size_t body_size)
+{
+  memset(r, 0, sizeof(*r));
+  r->content_length = -1;
+  r->body = body;
+  r->body_size = body_size;
+  r->body[0] = '\0';
+  r->state = STATUS_LINE;
+}
+
+static void append_body(http_response *r, const uint8_t *data, size_t len)
+{
+  size_t room = r->body_size - 1 - r->body_len;
+  if (len > room) {
+    len = room;
+    r->truncated = true;
+  }
+  memcpy(r->body + r->body_len, data, len);
+  r->body_len += len;
+  r->body[r->body_len] = '\0';
+}
+
+// Whether value has token in it, ignoring case, such as "close" in "Keep-Alive, Close"
+static bool has_token(const char *value, const char *token)
+{
+  size_t len = strlen(token);
+  for (const char *p = value; *p; p++) {
+    if (strncasecmp(p, token, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parse_status_line(http_response *r)
+{
+  // "HTTP/1.1 200 OK"
+  const char *line = r->line;
+  if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) line[7]) || line[8] != ' '
+      || !isdigit((unsigned char) line[9]) || !isdigit((unsigned char) line[10]) || !isdigit((unsigned char) line[11])) {
+    return false;
+  }
+  r->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+  r->keep_alive = line[7] != '0';
+  return true;
+}
+
+static bool parse_header_line(http_response *r)
+{
+  char *colon = strchr(r->line, ':');
+  if (!colon) {
+    return false;
+  }
+  *colon = '\0';
+  const char *value = colon + 1;
+  while (*value == ' ' || *value == '\t') {
+    value++;
+  }
+  if (strcasecmp(r->line, "Content-Length") == 0) {
+    char *end;
+    long length = strtol(value, &end, 10);
+    if (end == value || length < 0) {
+      return false;
+    }
+    r->content_length = length;
+  } else if (strcasecmp(r->line, "Transfer-Encoding") == 0) {
+    r->chunked = has_token(value, "chunked");
+  } else if (strcasecmp(r->line, "Connection") == 0) {
+    if (has_token(value, "close")) {
+      r->keep_alive = false;
+    } else if (has_token(value, "keep-alive")) {
+      r->keep_alive = true;
+    }
+  }
+  return true;
+}
+
+// Picks how the body is framed once the headers are read
+static void start_body(http_response *r)
+{
+  if (r->status >= 100 && r->status < 200) {
+    // an interim response such as 100 Continue, the real one follows
+    r->status = 0;
+    r->content_length = -1;
+    r->chunked = false;
+    r->state = STATUS_LINE;
+  } else if (r->status == 204 || r->status == 304) {
+    r->state = DONE;
+  } else if (r->chunked) {
+    r->state = CHUNK_SIZE_LINE;
+  } else if (r->content_length > 0) {
+    r->remaining = r->content_length;
+    r->state = BODY;
+  } else if (r->content_length == 0) {
+    r->state = DONE;
+  } else {
+    r->keep_alive = false;
+    r->state = BODY_UNTIL_CLOSE;
+  }
+}
+
+// Handles a complete line in r->line for the current state
+static void handle_line(http_response *r)
+{
+  switch (r->state) {
+    case STATUS_LINE:
+      r->state = parse_status_line(r) ? HEADER_LINE : FAILED;
+      break;
+    case HEADER_LINE:
+      if (r->line_len == 0) {
+        start_body(r);
+      } else if (!parse_header_line(r)) {
+        r->state = FAILED;
+      }
+      break;
+    case CHUNK_SIZE_LINE: {
+      char *end;
+      unsigned long size = strtoul(r->line, &end, 16);
+      // chunk extensions after a ';' are ignored
+      if (end == r->line || (*end != '\0' && *end != ';' && *end != ' ')) {
+        r->state = FAILED;
+      } else if (size == 0) {
+        r->state = TRAILER_LINE;
+      } else {
+        r->remaining = size;
+        r->state = CHUNK_DATA;
+      }
+      break;
+    }
+    case CHUNK_END_LINE:
+      r->state = r->line_len == 0 ? CHUNK_SIZE_LINE : FAILED;
+      break;
+    case TRAILER_LINE:
+      if (r->line_len == 0) {
+        r->state = DONE;
+      }
+      break;
+  }
+}
+
+static bool is_line_state(int state)
+{
+  return state == STATUS_LINE || state == HEADER_LINE || state == CHUNK_SIZE_LINE
+    || state == CHUNK_END_LINE || state == TRAILER_LINE;
+}
+
+http_response_result http_response_feed(http_response *r, const uint8_t *data, size_t len, size_t *used)
+{
+  size_t pos = 0;
+  while (pos < len && r->state != DONE && r->state != FAILED) {
+    if (is_line_state(r->state)) {
+      // lines are copied up to their end in one go, without the CR
+      const uint8_t *end = (const uint8_t *) memchr(data + pos, '\n', len - pos);
+      size_t n = (end ? end - data : len) - pos;
+      size_t room = HTTP_RESPONSE_LINE_SIZE - 1 - r->line_len;
+      memcpy(r->line + r->line_len, data + pos, n < room ? n : room);
+      r->line_len += n < room ? n : room;
+      pos += n;
+      if (!end) {
+        break;
+      }
+      pos++;
+      if (r->line_len > 0 && r->line[r->line_len - 1] == '\r') {
+        r->line_len--;
+      }
+      r->line[r->line_len] = '\0';
+      handle_line(r);
+      r->line_len = 0;
+    } else if (r->state == BODY || r->state == CHUNK_DATA) {
+      size_t n = len - pos < r->remaining ? len - pos : r->remaining;
+      append_body(r, data + pos, n);
+      pos += n;
+      r->remaining -= n;
+      if (r->remaining == 0) {
+        r->state = r->state == BODY ? DONE : CHUNK_END_LINE;
+      }
+    } else {
+      // BODY_UNTIL_CLOSE
+      append_body(r, data + pos, len - pos);
+      pos = len;
+    }
+  }
+  *used = pos;
+  if (r->state == DONE) {
+    return HTTP_RESPONSE_DONE;
+  }
+  return r->state == FAILED ? HTTP_RESPONSE_ERROR : HTTP_RESPONSE_MORE;
+}
+
+http_response_result http_response_end(http_response *r)
+{
+  if (r->state == BODY_UNTIL_CLOSE) {
+    r->state = DONE;
+  }
+  if (r->state == DONE) {
+    return HTTP_RESPONSE_DONE;
+  }
+  r->state = FAILED;
+  return HTTP_RESPONSE_ERROR;
+}
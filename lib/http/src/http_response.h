@@ -0,0 +1,47 @@
+// Incremental HTTP/1.1 response parser
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HTTP_RESPONSE_LINE_SIZE 256
+
+enum http_response_result
+{
+  HTTP_RESPONSE_MORE,   // the response isn't complete yet
+  HTTP_RESPONSE_DONE,
+  HTTP_RESPONSE_ERROR,  // malformed, or cut short by the end of the connection
+};
+
+struct http_response
+{
+  int status;           // status code, 0 until the status line is read
+  long content_length;  // -1 if the response has none
+  bool chunked;
+  bool keep_alive;      // the connection can take another request after this response
+  char *body;           // the caller's buffer, always NUL terminated
+  size_t body_size;
+  size_t body_len;
+  bool truncated;       // the body didn't fit, and body holds its first body_size - 1 bytes
+
+  // parser state
+  int state;
+  size_t remaining;     // bytes left of the body or the current chunk
+  char line[HTTP_RESPONSE_LINE_SIZE];
+  size_t line_len;
+};
+
+// Starts parsing a response into body, which holds body_size - 1 bytes of body and the NUL.
+void http_response_init(http_response *r, char *body, size_t body_size);
+
+// Parses the next len bytes received, and sets *used to the number of them that belong to this
+// response. The body is framed by Content-Length, chunked encoding or the end of the
+// connection, and interim 1xx responses are skipped. Header lines longer than
+// HTTP_RESPONSE_LINE_SIZE are cut short, which only matters for headers the parser doesn't use.
+http_response_result http_response_feed(http_response *r, const uint8_t *data, size_t len, size_t *used);
+
+// Tells the parser the connection was closed, which completes a body that runs to the end of
+// the connection and is an error anywhere else.
+http_response_result http_response_end(http_response *r);
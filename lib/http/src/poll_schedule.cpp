@@ -0,0 +1,22 @@
+#include "poll_schedule.h"
+
+void poll_schedule_init(poll_schedule *s, unsigned long initial_ms, float multiplier, unsigned long max_ms, float jitter)
+{
+  s->initial_ms = initial_ms;
+  s->multiplier = multiplier < 1 ? 1 : multiplier;
+  s->max_ms = max_ms < initial_ms ? initial_ms : max_ms;
+  s->jitter = jitter < 0 ? 0 : (jitter > 1 ? 1 : jitter);
+  s->delay_ms = initial_ms;
+  s->polls = 0;
+}
+
+unsigned long poll_schedule_next(poll_schedule *s, uint32_t random)
+{
+  // the random part is taken off the delay, so the cap is never passed
+  float spread = s->delay_ms * s->jitter;
+  unsigned long delay = s->delay_ms - (unsigned long) (spread * (random / 4294967296.0));
+  float next = s->delay_ms * s->multiplier;
+  s->delay_ms = next > s->max_ms ? s->max_ms : (unsigned long) next;
+  s->polls++;
+  return delay;
+}
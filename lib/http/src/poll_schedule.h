@@ -0,0 +1,25 @@
+// Backoff schedule for polling a request until it's answered
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+
+struct poll_schedule
+{
+  unsigned long initial_ms;   // delay before the first poll
+  float multiplier;           // each delay is the last one times this
+  unsigned long max_ms;       // delays don't grow past this
+  float jitter;               // fraction of each delay that's random, 0 for none to 1 for all of it
+  unsigned long delay_ms;     // the next delay before jitter
+  int polls;                  // delays handed out so far
+};
+
+// Starts a schedule, with the settings brought into range: a multiplier of at least 1, a cap
+// of at least the initial delay and jitter between 0 and 1.
+void poll_schedule_init(poll_schedule *s, unsigned long initial_ms, float multiplier, unsigned long max_ms, float jitter);
+
+// The time to wait before the next poll, and moves the schedule on. random is any 32 bit random
+// number, which picks where in its jitter range the delay falls, so devices that started
+// together drift apart instead of polling in step.
+unsigned long poll_schedule_next(poll_schedule *s, uint32_t random);
@@ -0,0 +1,50 @@
+#include "upload_tuner.h"
+
+#include <string.h>
+
+void upload_tuner_init(upload_tuner *t)
+{
+  memset(t, 0, sizeof(*t));
+  t->current = UPLOAD_SEGMENT_START;
+  t->best = UPLOAD_SEGMENT_START;
+}
+
+size_t upload_tuner_segment_size(const upload_tuner *t)
+{
+  return (size_t) UPLOAD_SEGMENT_MIN << t->current;
+}
+
+// The neighbor of the best size in direction (+1 or -1), or the other one at either end
+static int neighbor(int best, int direction)
+{
+  int i = best + direction;
+  return i >= 0 && i < UPLOAD_SEGMENT_SIZES ? i : best - direction;
+}
+
+void upload_tuner_record(upload_tuner *t, size_t bytes, unsigned long ms)
+{
+  if (bytes < UPLOAD_TUNE_MIN_BYTES) {
+    return;
+  }
+  float rate = (float) bytes / (ms > 0 ? ms : 1);
+  float *smoothed = &t->rates[t->current];
+  *smoothed = *smoothed == 0 ? rate : 0.7 * *smoothed + 0.3 * rate;
+  t->uploads++;
+
+  for (int i = 0; i < UPLOAD_SEGMENT_SIZES; i++) {
+    if (t->rates[i] > t->rates[t->best]) {
+      t->best = i;
+    }
+  }
+  int up = neighbor(t->best, 1);
+  int down = neighbor(t->best, -1);
+  if (t->rates[up] == 0) {
+    t->current = up;
+  } else if (t->rates[down] == 0) {
+    t->current = down;
+  } else if (t->uploads % UPLOAD_EXPLORE_EVERY == 0) {
+    t->current = (t->uploads / UPLOAD_EXPLORE_EVERY) % 2 ? up : down;
+  } else {
+    t->current = t->best;
+  }
+}
@@ -0,0 +1,38 @@
+// Write size tuning for request bodies
+// MIT License
+
+#pragma once
+
+#include <stddef.h>
+
+// Write sizes tried, 1 KB doubling up to 16 KB. 4 KB is a full TLS record with the ESP32's
+// mbedTLS, so smaller writes mean smaller records and larger ones fewer write calls.
+#define UPLOAD_SEGMENT_SIZES 5
+#define UPLOAD_SEGMENT_MIN 1024
+#define UPLOAD_SEGMENT_MAX (UPLOAD_SEGMENT_MIN << (UPLOAD_SEGMENT_SIZES - 1))
+#define UPLOAD_SEGMENT_START 2      // the index of 4 KB
+
+// Uploads shorter than this say little about the throughput and aren't recorded
+#define UPLOAD_TUNE_MIN_BYTES 8192
+
+// Every this many uploads one goes out with a size next to the best one, so the choice follows
+// the network when it changes
+#define UPLOAD_EXPLORE_EVERY 8
+
+struct upload_tuner
+{
+  float rates[UPLOAD_SEGMENT_SIZES];  // smoothed bytes per ms written with each size, 0 until tried
+  int current;                        // index of the size the next upload uses
+  int best;                           // index of the size with the highest rate so far
+  int uploads;                        // uploads recorded
+};
+
+void upload_tuner_init(upload_tuner *t);
+
+// The size to write the next upload's body in
+size_t upload_tuner_segment_size(const upload_tuner *t);
+
+// Records an upload of bytes that took ms to write with the current size, and picks the next
+// size: sizes next to the best one are tried once each, then the best one is used, with a
+// neighbor tried every UPLOAD_EXPLORE_EVERY uploads.
+void upload_tuner_record(upload_tuner *t, size_t bytes, unsigned long ms);
@@ -0,0 +1,57 @@
+#include "frame_score.h"
+
+#include <stdlib.h>
+
+#include "jpeg_dc.h"
+#include "motion.h"
+
+#ifdef ARDUINO
+  #include "Arduino.h"
+  #define score_alloc(size) ps_malloc(size)
+#else
+  #define score_alloc(size) malloc(size)
+#endif
+
+// Thumbnail of the frame being scored, grown to the largest frame seen
+static uint8_t *score_luma = NULL;
+static size_t score_luma_len = 0;
+
+bool score_frame(camera_fb_t *frame, frame_score *score)
+{
+  if (!frame || frame->format != PIXFORMAT_JPEG) {
+    return false;
+  }
+  int width = (frame->width + 7) / 8;
+  int height = (frame->height + 7) / 8;
+  size_t len = width * height;
+  if (len > score_luma_len) {
+    free(score_luma);
+    score_luma = (uint8_t *) score_alloc(len);
+    score_luma_len = score_luma ? len : 0;
+    if (!score_luma) {
+      return false;
+    }
+  }
+
+  uint32_t ac_bits = 0;
+  if (!jpeg_dc_luma(frame->buf, frame->len, score_luma, width, height, &ac_bits)) {
+    return false;
+  }
+
+  uint32_t sum = 0;
+  uint32_t clipped = 0;
+  for (size_t i = 0; i < len; i++) {
+    int pixel = score_luma[i];
+    sum += pixel;
+    clipped += pixel <= FRAME_SCORE_BLACK || pixel >= FRAME_SCORE_WHITE;
+  }
+
+  score->detail = (float) ac_bits / len;
+  score->mean_luma = sum / len;
+  score->clipped = (float) clipped / len;
+  // a mean at black or white halves the score, mid grey leaves it alone
+  float mid = MOTION_LUMA_MAX / 2.0f;
+  float off_mid = (score->mean_luma > mid ? score->mean_luma - mid : mid - score->mean_luma) / mid;
+  score->score = score->detail * (1.0f - score->clipped) * (1.0f - 0.5f * off_mid);
+  return true;
+}
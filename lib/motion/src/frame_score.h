@@ -0,0 +1,33 @@
+// Sharpness and exposure scoring for picking the best frame of a burst
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_camera.h"
+
+// Luma thumbnail pixels at or past these levels (out of MOTION_LUMA_MAX) count as clipped
+#define FRAME_SCORE_BLACK 2
+#define FRAME_SCORE_WHITE 125
+
+struct frame_score
+{
+  float detail;       // entropy coded bits of luma AC coefficients per 8x8 luma block
+  int mean_luma;      // mean of the 1/8 scale luma thumbnail, out of MOTION_LUMA_MAX
+  float clipped;      // share of thumbnail blocks that are black or white
+  float score;        // detail, scaled down for clipping and for a mean away from mid grey
+};
+
+// Scores a JPEG camera frame in a single pass over its entropy coded data, the same pass the
+// DC-only motion thumbnail takes (see jpeg_dc.h), so the cost is bounded by the JPEG's size
+// and no pixels are decoded. Motion blur and focus hunting remove the high frequencies that
+// the AC coefficients encode, and a frame caught while auto exposure is still settling is
+// dark or blown out, so of frames of the same scene at the same JPEG quality the one with the
+// highest score is the sharpest well exposed one. Scores of frames at different sizes or
+// qualities don't compare.
+//
+// Works at any frame size and doesn't touch the motion thumbnail. Returns false for JPEGs the
+// DC path can't read, such as progressive ones. Not reentrant.
+bool score_frame(camera_fb_t *frame, frame_score *score);
@@ -0,0 +1,230 @@
+#include "jpeg_crop.h"
+
+#include <string.h>
+
+#include "jpeg_reader.h"
+
+// Huffman codes by symbol, for writing the cropped scan
+struct jpeg_huff_encoder
+{
+  uint16_t code[256];
+  uint8_t size[256];  // 0 for symbols the table has no code for
+};
+
+// Bit writer for the entropy coded data, stuffing a zero byte after every 0xFF
+struct jpeg_bit_writer
+{
+  uint8_t *out;
+  size_t size;
+  size_t pos;
+  uint32_t bits;      // right aligned
+  int nbits;
+  bool overflow;
+};
+
+// Kept off the stack like the reader in jpeg_dc.cpp, so jpeg_crop is not reentrant either
+static jpeg_reader reader;
+static jpeg_huff_encoder dc_encoders[2];
+static jpeg_huff_encoder ac_encoders[2];
+
+static void build_huff_encoder(jpeg_huff_encoder *e, const jpeg_huff_table *t)
+{
+  memset(e->size, 0, sizeof(e->size));
+  int code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    for (int i = 0; i < t->counts[len]; i++, k++, code++) {
+      e->code[t->values[k]] = code;
+      e->size[t->values[k]] = len;
+    }
+    code <<= 1;
+  }
+}
+
+static inline void put_byte(jpeg_bit_writer *w, uint8_t byte)
+{
+  if (w->pos < w->size) {
+    w->out[w->pos++] = byte;
+  } else {
+    w->overflow = true;
+  }
+}
+
+// Writes the low n bits of value, n up to 16
+static inline void put_bits(jpeg_bit_writer *w, uint32_t value, int n)
+{
+  w->bits = (w->bits << n) | (value & ((1u << n) - 1));
+  w->nbits += n;
+  while (w->nbits >= 8) {
+    uint8_t byte = w->bits >> (w->nbits - 8);
+    put_byte(w, byte);
+    if (byte == 0xFF) {
+      put_byte(w, 0x00);
+    }
+    w->nbits -= 8;
+  }
+}
+
+// Pads the last byte with ones (JPEG F.1.2.3)
+static void flush_bits(jpeg_bit_writer *w)
+{
+  if (w->nbits > 0) {
+    put_bits(w, 0x7F, 8 - w->nbits);
+  }
+}
+
+// Reads one block and writes it again with the DC difference taken against pred_out
+static bool copy_block(jpeg_bits *b, jpeg_bit_writer *w, jpeg_component *comp, int *pred_out,
+                       const jpeg_huff_table *dc, const jpeg_huff_table *ac,
+                       const jpeg_huff_encoder *dc_enc, const jpeg_huff_encoder *ac_enc)
+{
+  int size = jpeg_decode_huff(b, dc);
+  if (size < 0 || size > 11) {
+    return false;
+  }
+  comp->pred += jpeg_extend(jpeg_get_bits(b, size), size);
+
+  int diff = comp->pred - *pred_out;
+  *pred_out = comp->pred;
+  int magnitude = diff < 0 ? -diff : diff;
+  int category = 0;
+  while (magnitude) {
+    category++;
+    magnitude >>= 1;
+  }
+  if (dc_enc->size[category] == 0) {
+    return false;
+  }
+  put_bits(w, dc_enc->code[category], dc_enc->size[category]);
+  if (category) {
+    put_bits(w, diff < 0 ? diff - 1 : diff, category);
+  }
+
+  int k = 1;
+  while (k < 64) {
+    int rs = jpeg_decode_huff(b, ac);
+    if (rs < 0) {
+      return false;
+    }
+    put_bits(w, ac_enc->code[rs], ac_enc->size[rs]);
+    int run = rs >> 4;
+    int bits = rs & 0x0F;
+    if (bits == 0) {
+      if (run != 15) {
+        break; // end of block
+      }
+      k += 16;
+    } else {
+      k += run + 1;
+      put_bits(w, jpeg_get_bits(b, bits), bits);
+    }
+  }
+  return true;
+}
+
+// Reads one block outside the crop, keeping only the DC prediction
+static inline bool skip_block(jpeg_bits *b, jpeg_component *comp, const jpeg_huff_table *dc, const jpeg_huff_table *ac)
+{
+  int size = jpeg_decode_huff(b, dc);
+  if (size < 0 || size > 11) {
+    return false;
+  }
+  comp->pred += jpeg_extend(jpeg_get_bits(b, size), size);
+  return jpeg_skip_ac(b, ac) >= 0;
+}
+
+static void write_u16(uint8_t *p, int v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+size_t jpeg_crop(const uint8_t *jpg, size_t len, jpeg_crop_rect *rect, uint8_t *out, size_t out_size)
+{
+  jpeg_reader *r = &reader;
+  if (!jpeg_read_headers(r, jpg, len)) {
+    return 0;
+  }
+
+  // the crop in whole MCUs
+  int mcu_width = 8 * r->max_h;
+  int mcu_height = 8 * r->max_v;
+  int left = rect->x < 0 ? 0 : rect->x;
+  int top = rect->y < 0 ? 0 : rect->y;
+  int mx0 = left / mcu_width;
+  int my0 = top / mcu_height;
+  int mx1 = (rect->x + rect->width + mcu_width - 1) / mcu_width;
+  int my1 = (rect->y + rect->height + mcu_height - 1) / mcu_height;
+  mx1 = mx1 > r->mcus_x ? r->mcus_x : mx1;
+  my1 = my1 > r->mcus_y ? r->mcus_y : my1;
+  if (mx1 <= mx0 || my1 <= my0) {
+    return 0;
+  }
+  rect->x = mx0 * mcu_width;
+  rect->y = my0 * mcu_height;
+  rect->width = (mx1 * mcu_width > r->width ? r->width : mx1 * mcu_width) - rect->x;
+  rect->height = (my1 * mcu_height > r->height ? r->height : my1 * mcu_height) - rect->y;
+
+  // the headers are copied up to the scan with the new size, and restarts turned off since
+  // the crop is written without restart markers
+  if (r->scan_offset + 2 > out_size) {
+    return 0;
+  }
+  memcpy(out, jpg, r->scan_offset);
+  write_u16(out + r->sof_offset + 5, rect->height);
+  write_u16(out + r->sof_offset + 7, rect->width);
+  if (r->dri_offset) {
+    write_u16(out + r->dri_offset + 4, 0);
+  }
+
+  for (int t = 0; t < 2; t++) {
+    if (r->dc_tables[t].defined) {
+      build_huff_encoder(&dc_encoders[t], &r->dc_tables[t]);
+    }
+    if (r->ac_tables[t].defined) {
+      build_huff_encoder(&ac_encoders[t], &r->ac_tables[t]);
+    }
+  }
+
+  jpeg_bit_writer w = { out, out_size - 2, r->scan_offset, 0, 0, false };
+  int pred_out[JPEG_MAX_COMPONENTS] = { 0 };
+  jpeg_bits bits = r->bits;
+  int restarts_left = r->restart_interval;
+  // MCUs below the crop don't affect it, so decoding stops at its last row
+  for (int my = 0; my < my1; my++) {
+    for (int mx = 0; mx < r->mcus_x; mx++) {
+      if (r->restart_interval) {
+        if (restarts_left == 0) {
+          if (!jpeg_restart(r, &bits)) {
+            return 0;
+          }
+          restarts_left = r->restart_interval;
+        }
+        restarts_left--;
+      }
+
+      bool inside = my >= my0 && mx >= mx0 && mx < mx1;
+      for (int c = 0; c < r->num_components; c++) {
+        jpeg_component *comp = &r->components[c];
+        const jpeg_huff_table *dc = &r->dc_tables[comp->td];
+        const jpeg_huff_table *ac = &r->ac_tables[comp->ta];
+        for (int block = 0; block < comp->h * comp->v; block++) {
+          bool ok = inside
+            ? copy_block(&bits, &w, comp, &pred_out[c], dc, ac, &dc_encoders[comp->td], &ac_encoders[comp->ta])
+            : skip_block(&bits, comp, dc, ac);
+          if (!ok) {
+            return 0;
+          }
+        }
+      }
+    }
+  }
+  flush_bits(&w);
+  if (w.overflow) {
+    return 0;
+  }
+  // room for the EOI marker was kept out of the writer's size
+  out[w.pos++] = 0xFF;
+  out[w.pos++] = 0xD9;
+  return w.pos;
+}
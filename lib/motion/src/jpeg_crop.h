@@ -0,0 +1,25 @@
+// Lossless cropping of baseline JPEGs
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct jpeg_crop_rect
+{
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+// Crops a baseline JPEG to the region covering rect without decoding it to pixels. The
+// coefficients of the blocks inside are entropy coded again with the original Huffman tables,
+// with only the DC predictions changed, so the crop is pixel for pixel the same as the
+// original. rect is grown outward to whole MCUs (16 pixels for 4:2:0, 8 for 4:4:4 and
+// grayscale), clipped to the image, and updated to the region actually cropped.
+//
+// Writes at most out_size bytes to out and returns the length of the crop, or 0 if the JPEG
+// can't be read (see jpeg_read_headers), the region is empty or the crop doesn't fit.
+size_t jpeg_crop(const uint8_t *jpg, size_t len, jpeg_crop_rect *rect, uint8_t *out, size_t out_size);
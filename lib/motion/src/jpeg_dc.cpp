@@ -0,0 +1,71 @@
+#include "jpeg_dc.h"
+
+#include "jpeg_reader.h"
+
+// The reader holds about 2.5KB of Huffman tables, so it is kept off the stack. This makes
+// jpeg_dc_luma not reentrant, which is fine for the single motion detector.
+static jpeg_reader reader;
+
+bool jpeg_dc_luma(const uint8_t *jpg, size_t len, uint8_t *luma, int width, int height, uint32_t *luma_ac_bits)
+{
+  jpeg_reader *r = &reader;
+  if (!jpeg_read_headers(r, jpg, len)) {
+    return false;
+  }
+  if ((r->width + 7) / 8 != width || (r->height + 7) / 8 != height) {
+    return false;
+  }
+
+  int q0 = r->quant_dc[r->components[0].tq];
+  jpeg_bits bits = r->bits;
+  uint32_t ac_bits = 0;
+  int restarts_left = r->restart_interval;
+  for (int my = 0; my < r->mcus_y; my++) {
+    for (int mx = 0; mx < r->mcus_x; mx++) {
+      if (r->restart_interval) {
+        if (restarts_left == 0) {
+          if (!jpeg_restart(r, &bits)) {
+            return false;
+          }
+          restarts_left = r->restart_interval;
+        }
+        restarts_left--;
+      }
+
+      for (int c = 0; c < r->num_components; c++) {
+        jpeg_component *comp = &r->components[c];
+        const jpeg_huff_table *dc = &r->dc_tables[comp->td];
+        const jpeg_huff_table *ac = &r->ac_tables[comp->ta];
+        for (int by = 0; by < comp->v; by++) {
+          for (int bx = 0; bx < comp->h; bx++) {
+            int size = jpeg_decode_huff(&bits, dc);
+            if (size < 0 || size > 11) {
+              return false;
+            }
+            comp->pred += jpeg_extend(jpeg_get_bits(&bits, size), size);
+            int ac_size = jpeg_skip_ac(&bits, ac);
+            if (ac_size < 0) {
+              return false;
+            }
+            if (c != 0) {
+              continue;
+            }
+            ac_bits += ac_size;
+            int x = mx * comp->h + bx;
+            int y = my * comp->v + by;
+            if (x < width && y < height) {
+              // the DC coefficient is eight times the block mean, level shifted by 128
+              int pixel = comp->pred * q0 / 8 + 128;
+              pixel = pixel < 0 ? 0 : (pixel > 255 ? 255 : pixel);
+              luma[y * width + x] = pixel >> 1;
+            }
+          }
+        }
+      }
+    }
+  }
+  if (luma_ac_bits) {
+    *luma_ac_bits = ac_bits;
+  }
+  return true;
+}
@@ -0,0 +1,19 @@
+// DC-only JPEG thumbnail decoding for motion detection
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Decodes the DC coefficient of every luma block of a baseline JPEG into a 7-bit luma
+// thumbnail at 1/8 scale, one byte per 8x8 block. The entropy coded AC coefficients still
+// have to be read to find the next block, but they are skipped without being dequantized,
+// and there is no IDCT, chroma or color conversion. Returns false for JPEGs it can't read
+// (progressive, 12-bit, corrupt) or whose thumbnail isn't width x height.
+//
+// If luma_ac_bits is given, it is set to the number of entropy coded bits the luma AC
+// coefficients took. Sharp edges and fine texture take more bits than a blurred view of the
+// same scene at the same quality, so this measures detail at full resolution for free.
+bool jpeg_dc_luma(const uint8_t *jpg, size_t len, uint8_t *luma, int width, int height,
+                  uint32_t *luma_ac_bits = NULL);
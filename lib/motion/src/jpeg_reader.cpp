@@ -0,0 +1,260 @@
+#include "jpeg_reader.h"
+
+#include <string.h>
+
+static uint16_t read_u16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+// Builds the decoding tables from the 16 code length counts and the symbol values of a DHT
+// segment (JPEG Annex C)
+static bool build_huff_table(jpeg_huff_table *t, const uint8_t *counts, const uint8_t *values, int num_values)
+{
+  memset(t->lookup_len, 0, sizeof(t->lookup_len));
+  t->counts[0] = 0;
+  memcpy(t->counts + 1, counts, 16);
+  memcpy(t->values, values, num_values);
+
+  int32_t code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    int count = counts[len - 1];
+    if (count == 0) {
+      t->maxcode[len] = -1;
+      t->valoffset[len] = 0;
+    } else {
+      t->valoffset[len] = k - code;
+      for (int i = 0; i < count; i++, k++, code++) {
+        // more codes than fit in len bits, checked before the code indexes the lookahead tables
+        if (code >= (1 << len)) {
+          return false;
+        }
+        if (len <= JPEG_HUFF_LOOKAHEAD) {
+          int shift = JPEG_HUFF_LOOKAHEAD - len;
+          for (int fill = 0; fill < (1 << shift); fill++) {
+            t->lookup_len[(code << shift) | fill] = len;
+            t->lookup_val[(code << shift) | fill] = values[k];
+          }
+        }
+      }
+      t->maxcode[len] = code - 1;
+    }
+    if (code > (1 << len)) {
+      return false;
+    }
+    code <<= 1;
+  }
+  t->maxcode[17] = 0x7FFFFFFF;
+  t->defined = true;
+  return true;
+}
+
+static void build_ac_skip_table(jpeg_huff_table *t)
+{
+  for (int look = 0; look < (1 << JPEG_HUFF_LOOKAHEAD); look++) {
+    int len = t->lookup_len[look];
+    int rs = t->lookup_val[look];
+    int run = rs >> 4;
+    int size = rs & 0x0F;
+    t->skip_len[look] = 0;
+    t->skip_coefs[look] = 0;
+    if (len == 0 || len + size > JPEG_HUFF_LOOKAHEAD) {
+      continue;
+    }
+    t->skip_len[look] = len + size;
+    if (size == 0) {
+      t->skip_coefs[look] = run == 15 ? 16 : 64;
+    } else {
+      t->skip_coefs[look] = run + 1;
+    }
+  }
+}
+
+static bool read_dqt(jpeg_reader *r, const uint8_t *seg, size_t seg_len)
+{
+  size_t i = 0;
+  while (i < seg_len) {
+    int precision = seg[i] >> 4;
+    int table = seg[i] & 0x0F;
+    size_t table_len = precision ? 128 : 64;
+    if (table > 3 || i + 1 + table_len > seg_len) {
+      return false;
+    }
+    r->quant_dc[table] = precision ? read_u16(seg + i + 1) : seg[i + 1];
+    i += 1 + table_len;
+  }
+  return true;
+}
+
+static bool read_dht(jpeg_reader *r, const uint8_t *seg, size_t seg_len)
+{
+  size_t i = 0;
+  while (i + 17 <= seg_len) {
+    int table_class = seg[i] >> 4;
+    int table = seg[i] & 0x0F;
+    const uint8_t *counts = seg + i + 1;
+    int num_values = 0;
+    for (int l = 0; l < 16; l++) {
+      num_values += counts[l];
+    }
+    if (table_class > 1 || table > 1 || num_values > 256 || i + 17 + num_values > seg_len) {
+      return false;
+    }
+    jpeg_huff_table *t = table_class == 0 ? &r->dc_tables[table] : &r->ac_tables[table];
+    if (!build_huff_table(t, counts, seg + i + 17, num_values)) {
+      return false;
+    }
+    if (table_class == 1) {
+      build_ac_skip_table(t);
+    }
+    i += 17 + num_values;
+  }
+  return true;
+}
+
+static bool read_sof(jpeg_reader *r, const uint8_t *seg, size_t seg_len)
+{
+  if (seg_len < 6 || seg[0] != 8) {
+    return false;
+  }
+  r->height = read_u16(seg + 1);
+  r->width = read_u16(seg + 3);
+  r->num_components = seg[5];
+  if (r->width == 0 || r->height == 0 || (r->num_components != 1 && r->num_components != 3)
+      || seg_len < 6 + 3 * (size_t) r->num_components) {
+    return false;
+  }
+  r->max_h = 1;
+  r->max_v = 1;
+  for (int c = 0; c < r->num_components; c++) {
+    jpeg_component *comp = &r->components[c];
+    comp->id = seg[6 + 3 * c];
+    comp->h = seg[7 + 3 * c] >> 4;
+    comp->v = seg[7 + 3 * c] & 0x0F;
+    comp->tq = seg[8 + 3 * c];
+    if (comp->h < 1 || comp->h > 2 || comp->v < 1 || comp->v > 2 || comp->tq > 3) {
+      return false;
+    }
+    r->max_h = comp->h > r->max_h ? comp->h : r->max_h;
+    r->max_v = comp->v > r->max_v ? comp->v : r->max_v;
+  }
+  if (r->num_components == 1) {
+    // a single component scan is not interleaved, so every MCU is one block
+    r->components[0].h = 1;
+    r->components[0].v = 1;
+    r->max_h = 1;
+    r->max_v = 1;
+  }
+  r->mcus_x = (r->width + 8 * r->max_h - 1) / (8 * r->max_h);
+  r->mcus_y = (r->height + 8 * r->max_v - 1) / (8 * r->max_v);
+  return true;
+}
+
+static bool read_sos(jpeg_reader *r, const uint8_t *seg, size_t seg_len)
+{
+  int num_components = seg_len > 0 ? seg[0] : 0;
+  if (num_components != r->num_components || seg_len < 4 + 2 * (size_t) num_components) {
+    return false;
+  }
+  for (int c = 0; c < num_components; c++) {
+    jpeg_component *comp = &r->components[c];
+    if (seg[1 + 2 * c] != comp->id) {
+      return false;
+    }
+    comp->td = seg[2 + 2 * c] >> 4;
+    comp->ta = seg[2 + 2 * c] & 0x0F;
+    if (comp->td > 1 || comp->ta > 1 || !r->dc_tables[comp->td].defined || !r->ac_tables[comp->ta].defined) {
+      return false;
+    }
+  }
+  const uint8_t *spectral = seg + 1 + 2 * num_components;
+  // Ss = 0, Se = 63, Ah/Al = 0 for a sequential scan
+  return spectral[0] == 0 && spectral[1] == 63 && spectral[2] == 0;
+}
+
+bool jpeg_read_headers(jpeg_reader *r, const uint8_t *jpg, size_t len)
+{
+  r->jpg = jpg;
+  r->len = len;
+  r->width = 0;
+  r->restart_interval = 0;
+  r->dri_offset = 0;
+  r->dc_tables[0].defined = false;
+  r->dc_tables[1].defined = false;
+  r->ac_tables[0].defined = false;
+  r->ac_tables[1].defined = false;
+
+  if (len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+    return false;
+  }
+  size_t i = 2;
+  while (i + 4 <= len) {
+    if (jpg[i] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = jpg[i + 1];
+    if (marker == 0xFF) {
+      i++;
+      continue;
+    }
+    size_t seg_len = read_u16(jpg + i + 2);
+    if (seg_len < 2 || i + 2 + seg_len > len) {
+      return false;
+    }
+    const uint8_t *seg = jpg + i + 4;
+    seg_len -= 2;
+
+    bool ok = true;
+    if (marker == 0xC0 || marker == 0xC1) {
+      r->sof_offset = i;
+      ok = read_sof(r, seg, seg_len);
+    } else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      ok = false; // progressive, lossless or arithmetic coded
+    } else if (marker == 0xC4) {
+      ok = read_dht(r, seg, seg_len);
+    } else if (marker == 0xDB) {
+      ok = read_dqt(r, seg, seg_len);
+    } else if (marker == 0xDD) {
+      ok = seg_len >= 2;
+      r->dri_offset = i;
+      r->restart_interval = ok ? read_u16(seg) : 0;
+    } else if (marker == 0xDA) {
+      if (r->width == 0 || !read_sos(r, seg, seg_len)) {
+        return false;
+      }
+      r->scan_offset = i + 4 + seg_len;
+      r->bits.jpg = jpg;
+      r->bits.len = len;
+      r->bits.pos = r->scan_offset;
+      r->bits.bits = 0;
+      r->bits.nbits = 0;
+      for (int c = 0; c < r->num_components; c++) {
+        r->components[c].pred = 0;
+      }
+      return true;
+    }
+    if (!ok) {
+      return false;
+    }
+    i += 2 + seg_len + 2;
+  }
+  return false;
+}
+
+bool jpeg_restart(jpeg_reader *r, jpeg_bits *b)
+{
+  b->bits = 0;
+  b->nbits = 0;
+  while (b->pos + 1 < b->len && !(b->jpg[b->pos] == 0xFF && b->jpg[b->pos + 1] >= 0xD0 && b->jpg[b->pos + 1] <= 0xD7)) {
+    b->pos++;
+  }
+  if (b->pos + 1 >= b->len) {
+    return false;
+  }
+  b->pos += 2;
+  for (int c = 0; c < r->num_components; c++) {
+    r->components[c].pred = 0;
+  }
+  return true;
+}
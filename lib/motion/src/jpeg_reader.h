@@ -0,0 +1,200 @@
+// Baseline JPEG header parsing and entropy decoding
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JPEG_HUFF_LOOKAHEAD 9
+#define JPEG_MAX_COMPONENTS 3
+
+struct jpeg_huff_table
+{
+  bool defined;
+  uint8_t counts[17];                             // number of codes of each length, from the DHT segment
+  uint8_t lookup_len[1 << JPEG_HUFF_LOOKAHEAD];   // code length for codes up to the lookahead, 0 if longer
+  uint8_t lookup_val[1 << JPEG_HUFF_LOOKAHEAD];
+  int32_t maxcode[18];                            // largest code of each length, -1 if none
+  int32_t valoffset[17];
+  uint8_t values[256];
+  // AC tables only: for lookaheads holding both a code and its value bits, the total bits
+  // to skip and the coefficients they cover (run + 1, or 64 for end of block), else 0
+  uint8_t skip_len[1 << JPEG_HUFF_LOOKAHEAD];
+  uint8_t skip_coefs[1 << JPEG_HUFF_LOOKAHEAD];
+};
+
+struct jpeg_component
+{
+  uint8_t id;
+  uint8_t h;          // horizontal and vertical sampling factors
+  uint8_t v;
+  uint8_t tq;         // quantization, DC and AC table numbers
+  uint8_t td;
+  uint8_t ta;
+  int pred;           // DC predictor while decoding the scan
+};
+
+// Bit reader over the entropy coded data. Decoders copy it into a local variable for their
+// inner loops so the compiler can keep it in registers.
+struct jpeg_bits
+{
+  const uint8_t *jpg;
+  size_t len;
+  size_t pos;
+  uint32_t bits;      // left aligned
+  int nbits;
+};
+
+struct jpeg_reader
+{
+  const uint8_t *jpg;
+  size_t len;
+  int width;
+  int height;
+  int num_components;
+  jpeg_component components[JPEG_MAX_COMPONENTS];
+  int max_h;
+  int max_v;
+  int mcus_x;
+  int mcus_y;
+  int restart_interval;
+  uint16_t quant_dc[4];
+  jpeg_huff_table dc_tables[2];
+  jpeg_huff_table ac_tables[2];
+  size_t sof_offset;    // offset of the SOF0/SOF1 marker
+  size_t dri_offset;    // offset of the DRI marker, 0 if there is none
+  size_t scan_offset;   // offset of the first entropy coded byte
+  jpeg_bits bits;
+};
+
+// Parses the headers of a baseline, 8-bit, single scan JPEG up to the start of the entropy
+// coded data, and resets the bit reader to it. Returns false for anything else.
+bool jpeg_read_headers(jpeg_reader *r, const uint8_t *jpg, size_t len);
+
+// Skips to the next restart marker and resets the DC predictors.
+bool jpeg_restart(jpeg_reader *r, jpeg_bits *b);
+
+// Tops the bit buffer up to at least 25 bits. Stuffed zero bytes are dropped, and once a
+// marker is reached the buffer is padded with zeros without consuming the marker.
+static inline void jpeg_fill_bits(jpeg_bits *b)
+{
+  // fast path: whole bytes with no 0xFF among them
+  while (b->nbits <= 24 && b->pos < b->len && b->jpg[b->pos] != 0xFF) {
+    b->bits |= (uint32_t) b->jpg[b->pos++] << (24 - b->nbits);
+    b->nbits += 8;
+  }
+  while (b->nbits <= 24) {
+    uint32_t byte = 0;
+    if (b->pos < b->len) {
+      byte = b->jpg[b->pos];
+      if (byte == 0xFF) {
+        uint8_t next = b->pos + 1 < b->len ? b->jpg[b->pos + 1] : 0xD9;
+        if (next == 0x00) {
+          b->pos += 2;
+        } else {
+          byte = 0;
+        }
+      } else {
+        b->pos++;
+      }
+    }
+    b->bits |= byte << (24 - b->nbits);
+    b->nbits += 8;
+  }
+}
+
+static inline int jpeg_get_bits(jpeg_bits *b, int n)
+{
+  if (n == 0) {
+    return 0;
+  }
+  if (b->nbits < n) {
+    jpeg_fill_bits(b);
+  }
+  int v = b->bits >> (32 - n);
+  b->bits <<= n;
+  b->nbits -= n;
+  return v;
+}
+
+static inline void jpeg_skip_bits(jpeg_bits *b, int n)
+{
+  if (b->nbits < n) {
+    jpeg_fill_bits(b);
+  }
+  b->bits <<= n;
+  b->nbits -= n;
+}
+
+// Turns an n bit magnitude into a signed coefficient value (JPEG F.2.2.1 EXTEND)
+static inline int jpeg_extend(int v, int n)
+{
+  return n == 0 ? 0 : (v < (1 << (n - 1)) ? v - (1 << n) + 1 : v);
+}
+
+// Decodes one Huffman symbol, or returns -1 for an invalid code.
+static inline int jpeg_decode_huff(jpeg_bits *b, const jpeg_huff_table *t)
+{
+  if (b->nbits < 16) {
+    jpeg_fill_bits(b);
+  }
+  int look = b->bits >> (32 - JPEG_HUFF_LOOKAHEAD);
+  int len = t->lookup_len[look];
+  if (len > 0) {
+    b->bits <<= len;
+    b->nbits -= len;
+    return t->lookup_val[look];
+  }
+  for (len = JPEG_HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+    int32_t code = b->bits >> (32 - len);
+    if (code <= t->maxcode[len]) {
+      b->bits <<= len;
+      b->nbits -= len;
+      return t->values[t->valoffset[len] + code];
+    }
+  }
+  return -1;
+}
+
+// Skips the 63 AC coefficients of a block and returns the number of bits they took, or -1 for
+// an invalid code. Short codes with their value bits are skipped in one step through the skip
+// table; the rest go through the regular Huffman decode.
+static inline int jpeg_skip_ac(jpeg_bits *b, const jpeg_huff_table *ac)
+{
+  int k = 1;
+  int bits = 0;
+  while (k < 64) {
+    if (b->nbits < 16) {
+      jpeg_fill_bits(b);
+    }
+    int look = b->bits >> (32 - JPEG_HUFF_LOOKAHEAD);
+    int skip_len = ac->skip_len[look];
+    if (skip_len > 0) {
+      b->bits <<= skip_len;
+      b->nbits -= skip_len;
+      bits += skip_len;
+      k += ac->skip_coefs[look];
+      continue;
+    }
+    int nbits = b->nbits;
+    int rs = jpeg_decode_huff(b, ac);
+    if (rs < 0) {
+      return -1;
+    }
+    bits += nbits - b->nbits;
+    int run = rs >> 4;
+    int size = rs & 0x0F;
+    if (size == 0) {
+      if (run != 15) {
+        return bits; // end of block
+      }
+      k += 16;
+    } else {
+      k += run + 1;
+      jpeg_skip_bits(b, size);
+      bits += size;
+    }
+  }
+  return bits;
+}
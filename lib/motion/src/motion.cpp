@@ -0,0 +1,411 @@
+#include "motion.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "img_converters.h"
+#include "jpeg_dc.h"
+
+#ifdef ARDUINO
+  #include "Arduino.h"
+  #include "esp_attr.h"
+  #include "esp_heap_caps.h"
+  #define motion_alloc(size) ps_malloc(size)
+#else
+  #define motion_alloc(size) malloc(size)
+  #define RTC_NOINIT_ATTR
+#endif
+
+#define MOTION_SLEEP_MAGIC 0x4D4F5431 // "MOT1"
+
+struct motion_sleep_reference
+{
+  uint32_t magic;
+  uint32_t checksum;
+  uint8_t luma[MOTION_SLEEP_LEN];
+};
+
+// Not initialized on any reset, so it is validated with the magic and checksum instead
+static RTC_NOINIT_ATTR motion_sleep_reference sleep_reference;
+
+uint8_t *frame_565 = NULL;
+uint8_t *frame_luma = NULL;
+uint8_t *frame_luma_old = NULL;
+uint16_t *frame_background = NULL;
+uint8_t *frame_luma_compact = NULL;
+uint8_t *frame_luma_old_compact = NULL;
+uint8_t *frame_luma_normalized = NULL;
+static bool background_seeded = false;
+static bool reference_set = false;
+static bool reference_compact = false;
+static int compact_frames_learned = 0;
+static bool frame_from_dc = false;
+
+// Luma planes are 16-byte aligned for the vector kernels. With PIE they also go in internal
+// RAM, since the kernel outruns the PSRAM cache.
+uint8_t *alloc_luma_plane()
+{
+#if defined(ARDUINO) && defined(MOTION_USE_PIE)
+  void *plane = heap_caps_aligned_alloc(16, MOTION_LUMA_LEN, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (!plane) {
+    plane = heap_caps_aligned_alloc(16, MOTION_LUMA_LEN, MALLOC_CAP_SPIRAM);
+  }
+  return (uint8_t *) plane;
+#elif defined(ARDUINO)
+  return (uint8_t *) heap_caps_aligned_alloc(16, MOTION_LUMA_LEN, MALLOC_CAP_SPIRAM);
+#else
+  return (uint8_t *) aligned_alloc(16, MOTION_LUMA_LEN);
+#endif
+}
+
+bool motion_begin()
+{
+  if (!frame_565) {
+    frame_565 = (uint8_t *) motion_alloc(FRAME_ARR_LEN);
+  }
+  if (!frame_luma) {
+    frame_luma = alloc_luma_plane();
+  }
+  if (!frame_luma_old) {
+    frame_luma_old = alloc_luma_plane();
+  }
+  if (!frame_background) {
+    frame_background = (uint16_t *) motion_alloc(MOTION_LUMA_LEN * sizeof(uint16_t));
+  }
+  if (!frame_565 || !frame_luma || !frame_luma_old || !frame_background) {
+    return false;
+  }
+  memset(frame_luma_old, 0, MOTION_LUMA_LEN);
+  background_seeded = false;
+  reference_set = false;
+  reference_compact = false;
+  return true;
+}
+
+static uint32_t sleep_reference_checksum(const uint8_t *luma)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < MOTION_SLEEP_LEN; i++) {
+    hash = (hash ^ luma[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Averages every 4x4 block of a thumbnail into one compact pixel
+static void downsample_luma(const uint8_t *luma, uint8_t *compact)
+{
+  for (int y = 0; y < MOTION_SLEEP_HEIGHT; y++) {
+    for (int x = 0; x < MOTION_SLEEP_WIDTH; x++) {
+      const uint8_t *block = luma + y * MOTION_SLEEP_SCALE * MOTION_THUMB_WIDTH + x * MOTION_SLEEP_SCALE;
+      int sum = 0;
+      for (int by = 0; by < MOTION_SLEEP_SCALE; by++) {
+        for (int bx = 0; bx < MOTION_SLEEP_SCALE; bx++) {
+          sum += block[by * MOTION_THUMB_WIDTH + bx];
+        }
+      }
+      compact[y * MOTION_SLEEP_WIDTH + x] = (sum + MOTION_SLEEP_SCALE * MOTION_SLEEP_SCALE / 2) / (MOTION_SLEEP_SCALE * MOTION_SLEEP_SCALE);
+    }
+  }
+}
+
+// Fills every 4x4 block of a thumbnail with its compact pixel
+static void upsample_luma(const uint8_t *compact, uint8_t *luma)
+{
+  for (int y = 0; y < MOTION_THUMB_HEIGHT; y++) {
+    const uint8_t *row = compact + (y / MOTION_SLEEP_SCALE) * MOTION_SLEEP_WIDTH;
+    for (int x = 0; x < MOTION_THUMB_WIDTH; x++) {
+      luma[y * MOTION_THUMB_WIDTH + x] = row[x / MOTION_SLEEP_SCALE];
+    }
+  }
+}
+
+// The thumbnail with every 4x4 block replaced by its mean, at full size for the diff kernels
+static void compact_view(const uint8_t *luma, uint8_t *view)
+{
+  uint8_t compact[MOTION_SLEEP_LEN];
+  downsample_luma(luma, compact);
+  upsample_luma(compact, view);
+}
+
+void motion_save_reference()
+{
+  if (!reference_set) {
+    return;
+  }
+  downsample_luma(frame_luma_old, sleep_reference.luma);
+  sleep_reference.checksum = sleep_reference_checksum(sleep_reference.luma);
+  sleep_reference.magic = MOTION_SLEEP_MAGIC;
+}
+
+bool motion_restore_reference()
+{
+  if (!frame_luma_old || !frame_background || sleep_reference.magic != MOTION_SLEEP_MAGIC
+      || sleep_reference.checksum != sleep_reference_checksum(sleep_reference.luma)) {
+    return false;
+  }
+  if (!frame_luma_compact) {
+    frame_luma_compact = alloc_luma_plane();
+  }
+  if (!frame_luma_old_compact) {
+    frame_luma_old_compact = alloc_luma_plane();
+  }
+  if (!frame_luma_compact || !frame_luma_old_compact) {
+    return false;
+  }
+  upsample_luma(sleep_reference.luma, frame_luma_old);
+  // also seeds the background model, in case background mode is on
+  for (int i = 0; i < MOTION_LUMA_LEN; i++) {
+    frame_background[i] = frame_luma_old[i] << 8;
+  }
+  background_seeded = true;
+  reference_set = true;
+  reference_compact = true;
+  compact_frames_learned = 0;
+  return true;
+}
+
+bool decode_motion_frame(camera_fb_t *frame)
+{
+  if (!frame || !frame_luma) {
+    return false;
+  }
+  if (jpeg_dc_luma(frame->buf, frame->len, frame_luma, MOTION_THUMB_WIDTH, MOTION_THUMB_HEIGHT)) {
+    frame_from_dc = true;
+    return true;
+  }
+  return decode_motion_frame_full(frame);
+}
+
+bool decode_motion_frame_full(camera_fb_t *frame)
+{
+  frame_from_dc = false;
+  if (!frame || !frame_565 || !frame_luma) {
+    return false;
+  }
+  // the thumbnail buffers only fit SXGA frames at 1/8 scale
+  if (frame->width != MOTION_THUMB_WIDTH * 8 || frame->height != MOTION_THUMB_HEIGHT * 8) {
+    return false;
+  }
+  if (!jpg2rgb565(frame->buf, frame->len, frame_565, JPG_SCALE_8X)) {
+    return false;
+  }
+  rgb565_to_luma(frame_565, frame_luma, MOTION_LUMA_LEN);
+  return true;
+}
+
+bool motion_frame_from_dc()
+{
+  return frame_from_dc;
+}
+
+void motion_default_config(motion_config *config, int alpha, int beta)
+{
+  config->alpha = alpha;
+  config->beta = beta;
+  config->grid = false;
+  config->min_cells = 1;
+  config->learning_rate = 0;
+  config->normalize_lighting = false;
+  config->hold_reference = false;
+  int cell_alpha = (long) alpha * MOTION_CELL_PIXELS * 2 / FRAME_ARR_LEN;
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    config->cell_alpha[i] = cell_alpha;
+    config->cell_included[i] = true;
+  }
+}
+
+int motion_parse_cell_mask(const char *text, bool *cell_included)
+{
+  int cells = 0;
+  for (const char *c = text; *c != '\0' && cells < MOTION_GRID_CELLS; c++) {
+    if (*c == '1' || *c == '0') {
+      cell_included[cells++] = *c == '1';
+    }
+  }
+  return cells;
+}
+
+motion_result evaluate_motion(const motion_config &config, const uint8_t *luma, const uint8_t *luma_old)
+{
+  motion_result res;
+  count_cell_diffs(luma, luma_old, config.beta, res.cell_diffs);
+
+  res.num_diffs = 0;
+  res.active_cells = 0;
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    if (!config.cell_included[i]) {
+      continue;
+    }
+    res.num_diffs += res.cell_diffs[i];
+    if (res.cell_diffs[i] > config.cell_alpha[i]) {
+      res.active_cells++;
+    }
+  }
+
+  if (config.grid) {
+    res.motion = res.active_cells >= config.min_cells;
+  } else {
+    res.motion = res.num_diffs > config.alpha;
+  }
+  res.lighting_change = false;
+  res.lighting_gain = MOTION_GAIN_ONE;
+  res.lighting_offset = 0;
+  return res;
+}
+
+motion_result compare_motion_frame(const motion_config &config)
+{
+  // A compact reference restored after deep sleep is compared against an equally compact
+  // frame. The background model keeps learning from full frames, and is compacted for the
+  // comparison until it has mostly replaced the restored blocks.
+  const uint8_t *luma = frame_luma;
+  const uint8_t *luma_old = frame_luma_old;
+  if (reference_compact) {
+    compact_view(frame_luma, frame_luma_compact);
+    luma = frame_luma_compact;
+    if (config.learning_rate > 0) {
+      compact_view(frame_luma_old, frame_luma_old_compact);
+      luma_old = frame_luma_old_compact;
+    }
+  }
+
+  motion_result res = evaluate_motion(config, luma, luma_old);
+  if (config.normalize_lighting && reference_set && res.motion) {
+    if (!frame_luma_normalized) {
+      frame_luma_normalized = alloc_luma_plane();
+    }
+    int gain;
+    int offset;
+    fit_lighting(config, luma, luma_old, &gain, &offset);
+    if (frame_luma_normalized && (gain != MOTION_GAIN_ONE || offset != 0)) {
+      normalize_lighting(luma, frame_luma_normalized, MOTION_LUMA_LEN, gain, offset);
+      res = evaluate_motion(config, frame_luma_normalized, luma_old);
+      res.lighting_change = !res.motion;
+      res.lighting_gain = gain;
+      res.lighting_offset = offset;
+    }
+  }
+
+  if (config.learning_rate > 0) {
+    int rate = background_seeded && !res.lighting_change ? config.learning_rate : MOTION_RATE_ONE;
+    update_background(frame_background, frame_luma_old, frame_luma, MOTION_LUMA_LEN, rate);
+    background_seeded = true;
+    // after 4 / rate frames less than 2% of the restored model is left
+    if (rate == MOTION_RATE_ONE || (reference_compact && ++compact_frames_learned >= 4 * MOTION_RATE_ONE / rate)) {
+      reference_compact = false;
+    }
+  } else {
+    if ((res.motion && !config.hold_reference) || res.lighting_change) {
+      memcpy(frame_luma_old, frame_luma, MOTION_LUMA_LEN);
+      reference_compact = false;
+    }
+    // the background is reseeded if background mode is turned on later
+    background_seeded = false;
+  }
+  reference_set = true;
+  return res;
+}
+
+motion_result compare_motion_frame(int alpha, int beta)
+{
+  motion_config config;
+  motion_default_config(&config, alpha, beta);
+  return compare_motion_frame(config);
+}
+
+void motion_accept_frame(const motion_config &config)
+{
+  if (config.learning_rate > 0) {
+    return;
+  }
+  memcpy(frame_luma_old, frame_luma, MOTION_LUMA_LEN);
+  reference_compact = false;
+}
+
+// Grows the span [*start, *start + *size) by padding on both sides and around its center to
+// at least min_size, then shifts and clips it into [0, limit)
+static void grow_span(int *start, int *size, int padding, int min_size, int limit)
+{
+  int lo = *start - padding;
+  int hi = *start + *size + padding;
+  if (hi - lo < min_size) {
+    int center = (lo + hi) / 2;
+    lo = center - min_size / 2;
+    hi = lo + min_size;
+  }
+  if (lo < 0) {
+    hi -= lo;
+    lo = 0;
+  }
+  if (hi > limit) {
+    lo -= hi - limit;
+    hi = limit;
+  }
+  *start = lo < 0 ? 0 : lo;
+  *size = hi - *start;
+}
+
+bool motion_region(const motion_config &config, const motion_result &result, int frame_width, int frame_height,
+                   int padding, int min_size, motion_box *box)
+{
+  int col0 = MOTION_GRID_COLS;
+  int row0 = MOTION_GRID_ROWS;
+  int col1 = -1;
+  int row1 = -1;
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    if (!config.cell_included[i] || result.cell_diffs[i] <= config.cell_alpha[i]) {
+      continue;
+    }
+    int col = i % MOTION_GRID_COLS;
+    int row = i / MOTION_GRID_COLS;
+    col0 = col < col0 ? col : col0;
+    row0 = row < row0 ? row : row0;
+    col1 = col > col1 ? col : col1;
+    row1 = row > row1 ? row : row1;
+  }
+  if (col1 < 0) {
+    return false;
+  }
+
+  // thumbnail pixels are scale x scale frame pixels, the last row and column possibly cut short
+  int scale = frame_width / MOTION_THUMB_WIDTH;
+  box->x = col0 * MOTION_CELL_WIDTH * scale;
+  box->y = row0 * MOTION_CELL_HEIGHT * scale;
+  box->width = (col1 + 1) * MOTION_CELL_WIDTH * scale - box->x;
+  box->height = (row1 + 1) * MOTION_CELL_HEIGHT * scale - box->y;
+  grow_span(&box->x, &box->width, padding, min_size, frame_width);
+  grow_span(&box->y, &box->height, padding, min_size, frame_height);
+  return box->width > 0 && box->height > 0;
+}
+
+bool is_motion_detected(camera_fb_t *frame, const motion_config &config)
+{
+  if (!decode_motion_frame(frame)) {
+    return false;
+  }
+  return compare_motion_frame(config).motion;
+}
+
+bool is_motion_detected(camera_fb_t *frame, int alpha, int beta)
+{
+  if (!decode_motion_frame(frame)) {
+    return false;
+  }
+  return compare_motion_frame(alpha, beta).motion;
+}
+
+const uint8_t *motion_reference_luma()
+{
+  return frame_luma_old;
+}
+
+const uint8_t *motion_frame_rgb565()
+{
+  return frame_565;
+}
+
+const uint8_t *motion_frame_luma()
+{
+  return frame_luma;
+}
@@ -0,0 +1,221 @@
+// Motion detection for Groundlight ESP32 cameras
+// MIT License
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_camera.h"
+
+// The motion thumbnail is the SXGA camera frame decoded at 1/8 scale into RGB565 (160x128 pixels)
+#define MOTION_THUMB_WIDTH 160
+#define MOTION_THUMB_HEIGHT 128
+#define FRAME_ARR_LEN (1280 * 1024 * 2 / 64)
+#define COLOR_VAL_MAX 31
+
+// Motion is compared on a 7-bit luma plane with one byte per thumbnail pixel
+#define MOTION_LUMA_LEN (FRAME_ARR_LEN / 2)
+#define MOTION_LUMA_MAX 127
+
+// Build with MOTION_USE_PIE on ESP32-S3 targets to use the PIE vector instructions
+#if defined(ESP_PLATFORM)
+  #include "sdkconfig.h"
+#endif
+#if defined(MOTION_USE_PIE) && !defined(CONFIG_IDF_TARGET_ESP32S3)
+  #undef MOTION_USE_PIE
+#endif
+
+// The thumbnail is split into a grid of 16x16 pixel cells, numbered row by row from the top left
+#define MOTION_GRID_COLS 10
+#define MOTION_GRID_ROWS 8
+#define MOTION_GRID_CELLS (MOTION_GRID_COLS * MOTION_GRID_ROWS)
+#define MOTION_CELL_WIDTH (MOTION_THUMB_WIDTH / MOTION_GRID_COLS)
+#define MOTION_CELL_HEIGHT (MOTION_THUMB_HEIGHT / MOTION_GRID_ROWS)
+#define MOTION_CELL_PIXELS (MOTION_CELL_WIDTH * MOTION_CELL_HEIGHT)
+
+// The reference kept across deep sleep is the thumbnail averaged over 4x4 pixel blocks (40x32)
+#define MOTION_SLEEP_SCALE 4
+#define MOTION_SLEEP_WIDTH (MOTION_THUMB_WIDTH / MOTION_SLEEP_SCALE)
+#define MOTION_SLEEP_HEIGHT (MOTION_THUMB_HEIGHT / MOTION_SLEEP_SCALE)
+#define MOTION_SLEEP_LEN (MOTION_SLEEP_WIDTH * MOTION_SLEEP_HEIGHT)
+
+// Background learning rates are fixed point, out of MOTION_RATE_ONE
+#define MOTION_RATE_ONE 256
+
+// Lighting gains are fixed point, out of MOTION_GAIN_ONE
+#define MOTION_GAIN_ONE 256
+
+struct motion_config
+{
+  int alpha;                                // frame mode: changed pixels needed for motion
+  int beta;                                 // luma change that marks a pixel as changed (out of MOTION_LUMA_MAX)
+  bool grid;                                // grid mode: decide per cell instead of over the whole frame
+  int min_cells;                            // grid mode: cells with motion needed to report motion
+  uint16_t cell_alpha[MOTION_GRID_CELLS];   // grid mode: changed pixels needed for motion in each cell
+  bool cell_included[MOTION_GRID_CELLS];    // cells that are excluded never count towards motion
+  int learning_rate;                        // background mode when > 0: share of every frame blended into the
+                                            // background, out of MOTION_RATE_ONE
+  bool normalize_lighting;                  // match the frame's brightness to the reference before comparing
+  bool hold_reference;                      // snapshot mode: frames with motion don't replace the reference
+                                            // until motion_accept_frame, for debouncing
+};
+
+struct motion_result
+{
+  bool motion;
+  int num_diffs;                            // changed pixels in included cells
+  int active_cells;                         // included cells over their cell_alpha
+  uint16_t cell_diffs[MOTION_GRID_CELLS];   // changed pixels in every cell, included or not
+  bool lighting_change;                     // normalize_lighting: the frame only changed in brightness, so
+                                            // it would have been motion without normalization but isn't
+  int lighting_gain;                        // normalize_lighting: frame = gain * reference + offset, with the
+  int lighting_offset;                      // gain out of MOTION_GAIN_ONE and the offset in luma
+};
+
+// Frame mode config with every cell included. cell_alpha defaults to the same fraction of
+// a cell as alpha is of the frame.
+void motion_default_config(motion_config *config, int alpha, int beta);
+
+// Reads a cell mask of '1' (include) and '0' (exclude) characters, one per cell row by row.
+// Other characters are ignored, so rows may be separated. Returns the number of cells read;
+// the mask is only valid when that equals MOTION_GRID_CELLS.
+int motion_parse_cell_mask(const char *text, bool *cell_included);
+
+// Allocates the current and reference thumbnails. Call once before any other motion function.
+bool motion_begin();
+
+// Calibration measures the sensor noise on a burst of frames of a still scene. The first half
+// of the burst measures how much pixels change between frames, which sets beta; the second
+// half counts how many pixels still pass beta, which sets alpha and the cell alphas.
+#define MOTION_CALIBRATION_MAX_BETA 48   // above this the scene was not still
+
+struct motion_calibration
+{
+  int frames;                               // frames added so far
+  int beta_frames;                          // frames used for beta
+  uint32_t change_histogram[MOTION_LUMA_MAX + 1];
+  int beta;
+  int max_diffs;
+  uint16_t max_cell_diffs[MOTION_GRID_CELLS];
+  uint8_t *luma_prev;
+};
+
+// Starts a calibration over a burst of the given number of frames (at least 4).
+bool motion_calibration_begin(motion_calibration *cal, int frames);
+
+// Adds the current thumbnail, after decode_motion_frame.
+void motion_calibration_add_frame(motion_calibration *cal);
+
+// Derives alpha, beta and the cell alphas into config, leaving its other settings alone, and
+// frees the calibration. Returns false if there were too few frames or the scene was not still.
+bool motion_calibration_end(motion_calibration *cal, motion_config *config);
+
+// Saves a compact copy of the reference to RTC memory, which survives deep sleep and
+// restarts. Call before going to sleep. Does nothing before the first comparison.
+void motion_save_reference();
+
+// Restores the reference saved by motion_save_reference, if there is a valid one. Frames are
+// compared at the compact resolution until motion replaces the reference with a full one.
+// Call after motion_begin.
+bool motion_restore_reference();
+
+// Decodes a JPEG camera frame into the current luma thumbnail. Baseline JPEGs are read from
+// their DC coefficients alone (see jpeg_dc.h); anything else falls back to
+// decode_motion_frame_full.
+bool decode_motion_frame(camera_fb_t *frame);
+
+// Decodes a JPEG camera frame through the full RGB565 decoder, filling both the RGB565 and
+// the luma thumbnail.
+bool decode_motion_frame_full(camera_fb_t *frame);
+
+// Whether the current thumbnail came from the DC-only path, in which case the RGB565
+// thumbnail was not updated.
+bool motion_frame_from_dc();
+
+// Compares the current thumbnail against the reference. A pixel counts as changed when its
+// luma differs by more than beta (out of MOTION_LUMA_MAX). In frame mode motion is reported
+// when more than alpha pixels changed in the included cells; in grid mode when at least
+// min_cells included cells each have more than their cell_alpha changed pixels.
+//
+// With normalize_lighting the frame is first mapped through the gain and offset that best fit
+// it to the reference, so lights switching on or an exposure step don't count as motion. A
+// frame that only passes without normalization is reported as a lighting change instead, and
+// becomes the new reference (or reseeds the background).
+//
+// Without a learning rate the reference is replaced by the current thumbnail on motion, unless
+// hold_reference leaves that to motion_accept_frame. With one the reference is a background
+// model that every frame is blended into, so slow changes such as daylight are absorbed and
+// motion means a departure from the background. The model is seeded from the first frame
+// compared.
+motion_result compare_motion_frame(const motion_config &config);
+motion_result compare_motion_frame(int alpha, int beta);
+
+// Makes the current thumbnail the reference after a frame compared with hold_reference set
+// turned out to be motion worth acting on, e.g. once enough frames in a row had motion. A
+// change that stays is then compared against the frames before it until that's decided.
+// Does nothing in background mode, where the model takes frames in by itself.
+void motion_accept_frame(const motion_config &config);
+
+// Compares any two thumbnail luma planes the same way, without touching the reference.
+motion_result evaluate_motion(const motion_config &config, const uint8_t *luma, const uint8_t *luma_old);
+
+// A region of a camera frame, in frame pixels
+struct motion_box
+{
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+// The region of a frame_width x frame_height camera frame with motion: the bounding box of the
+// included cells over their cell_alpha, scaled up from the thumbnail, grown by padding pixels
+// on every side and to at least min_size pixels in both directions, and clipped to the frame.
+// Returns false if no cell is over its cell_alpha, which can happen in frame mode when the
+// change is spread thinly over the frame.
+bool motion_region(const motion_config &config, const motion_result &result, int frame_width, int frame_height,
+                   int padding, int min_size, motion_box *box);
+
+// Decodes and compares in one step.
+bool is_motion_detected(camera_fb_t *frame, const motion_config &config);
+bool is_motion_detected(camera_fb_t *frame, int alpha, int beta);
+
+// The luma reference the current thumbnail is compared against (MOTION_LUMA_LEN bytes)
+const uint8_t *motion_reference_luma();
+
+// The current thumbnail, as RGB565 (big endian, FRAME_ARR_LEN bytes) and as luma (MOTION_LUMA_LEN bytes)
+const uint8_t *motion_frame_rgb565();
+const uint8_t *motion_frame_luma();
+
+// Fits frame = gain * reference + offset over the mean luma of the included grid cells. Cells
+// that stray far from the fit, such as ones with local motion, are left out and the fit is
+// repeated.
+void fit_lighting(const motion_config &config, const uint8_t *luma, const uint8_t *luma_old, int *gain, int *offset);
+
+// Maps a frame through the inverse of a lighting fit, so it matches the reference's lighting.
+void normalize_lighting(const uint8_t *luma, uint8_t *normalized, size_t len, int gain, int offset);
+
+// Allocates a thumbnail sized luma plane aligned for the diff kernels. Free with free().
+uint8_t *alloc_luma_plane();
+
+// Converts big endian RGB565 pixels to 7-bit luma.
+void rgb565_to_luma(const uint8_t *rgb565, uint8_t *luma, size_t pixels);
+
+// Counts pixels where any RGB565 channel differs by more than beta (out of COLOR_VAL_MAX).
+// This is the original per-channel detector, kept for comparison in the benchmark.
+int count_rgb565_diffs(const uint8_t *frame, const uint8_t *frame_old, size_t len, int beta);
+
+// Counts luma pixels differing by more than beta. Uses the PIE kernel when available and a
+// portable four-pixels-per-word kernel otherwise.
+int count_luma_diffs(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta);
+
+// One pixel at a time reference for count_luma_diffs.
+int count_luma_diffs_scalar(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta);
+
+// Counts changed pixels in every grid cell of two thumbnail luma planes.
+void count_cell_diffs(const uint8_t *luma, const uint8_t *luma_old, int beta, uint16_t *cell_diffs);
+
+// Blends luma into a background model kept as luma << 8, at rate out of MOTION_RATE_ONE, and
+// writes the rounded model to background_luma. A rate of MOTION_RATE_ONE copies luma.
+void update_background(uint16_t *background, uint8_t *background_luma, const uint8_t *luma, size_t len, int rate);
@@ -0,0 +1,91 @@
+#include "motion.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Share of pixels that may pass beta on noise alone, in parts per thousand
+#define CALIBRATION_NOISE_PERMILLE 1
+// Margin on the changed pixels counted on a still scene, and the smallest thresholds
+#define CALIBRATION_ALPHA_MARGIN 2
+#define CALIBRATION_MIN_BETA 3
+#define CALIBRATION_MIN_ALPHA (MOTION_LUMA_LEN / 200)
+#define CALIBRATION_MIN_CELL_ALPHA (MOTION_CELL_PIXELS / 64)
+
+bool motion_calibration_begin(motion_calibration *cal, int frames)
+{
+  memset(cal, 0, sizeof(*cal));
+  if (frames < 4) {
+    return false;
+  }
+  // the first frame has nothing to compare against
+  cal->beta_frames = (frames - 1) / 2;
+  cal->luma_prev = alloc_luma_plane();
+  return cal->luma_prev != NULL;
+}
+
+// Smallest change that no more than the allowed share of pixels went over
+static int beta_from_histogram(const uint32_t *histogram)
+{
+  uint64_t total = 0;
+  for (int d = 0; d <= MOTION_LUMA_MAX; d++) {
+    total += histogram[d];
+  }
+  uint64_t allowed = total * CALIBRATION_NOISE_PERMILLE / 1000;
+  uint64_t above = total;
+  for (int d = 0; d <= MOTION_LUMA_MAX; d++) {
+    above -= histogram[d];
+    if (above <= allowed) {
+      return d;
+    }
+  }
+  return MOTION_LUMA_MAX;
+}
+
+void motion_calibration_add_frame(motion_calibration *cal)
+{
+  const uint8_t *luma = motion_frame_luma();
+  if (!cal->luma_prev || !luma) {
+    return;
+  }
+  if (cal->frames > 0 && cal->frames <= cal->beta_frames) {
+    for (int i = 0; i < MOTION_LUMA_LEN; i++) {
+      cal->change_histogram[abs(luma[i] - cal->luma_prev[i])]++;
+    }
+    if (cal->frames == cal->beta_frames) {
+      cal->beta = beta_from_histogram(cal->change_histogram);
+      cal->beta = cal->beta < CALIBRATION_MIN_BETA ? CALIBRATION_MIN_BETA : cal->beta;
+    }
+  } else if (cal->frames > cal->beta_frames) {
+    uint16_t cell_diffs[MOTION_GRID_CELLS];
+    count_cell_diffs(luma, cal->luma_prev, cal->beta, cell_diffs);
+    int diffs = 0;
+    for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+      diffs += cell_diffs[c];
+      if (cell_diffs[c] > cal->max_cell_diffs[c]) {
+        cal->max_cell_diffs[c] = cell_diffs[c];
+      }
+    }
+    if (diffs > cal->max_diffs) {
+      cal->max_diffs = diffs;
+    }
+  }
+  memcpy(cal->luma_prev, luma, MOTION_LUMA_LEN);
+  cal->frames++;
+}
+
+bool motion_calibration_end(motion_calibration *cal, motion_config *config)
+{
+  free(cal->luma_prev);
+  cal->luma_prev = NULL;
+  if (cal->frames <= cal->beta_frames + 1 || cal->beta > MOTION_CALIBRATION_MAX_BETA) {
+    return false;
+  }
+  config->beta = cal->beta;
+  config->alpha = cal->max_diffs * CALIBRATION_ALPHA_MARGIN;
+  config->alpha = config->alpha < CALIBRATION_MIN_ALPHA ? CALIBRATION_MIN_ALPHA : config->alpha;
+  for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+    int cell_alpha = cal->max_cell_diffs[c] * CALIBRATION_ALPHA_MARGIN;
+    config->cell_alpha[c] = cell_alpha < CALIBRATION_MIN_CELL_ALPHA ? CALIBRATION_MIN_CELL_ALPHA : cell_alpha;
+  }
+  return true;
+}
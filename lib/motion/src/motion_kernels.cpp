@@ -0,0 +1,222 @@
+#include "motion.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void rgb565_to_luma(const uint8_t *rgb565, uint8_t *luma, size_t pixels)
+{
+  for (size_t i = 0; i < pixels; i++) {
+    uint16_t color = (rgb565[2 * i] << 8) | rgb565[2 * i + 1];
+    uint16_t r = (color >> 11) & 0b11111;
+    uint16_t g = (color >> 5) & 0b111111;
+    uint16_t b = color & 0b11111;
+    // BT.601 weights with the channels scaled to 8 bits, halved to 7 bits
+    luma[i] = (r * 1259 + g * 1216 + b * 480) >> 10;
+  }
+}
+
+int count_rgb565_diffs(const uint8_t *frame, const uint8_t *frame_old, size_t len, int beta)
+{
+  int num_diffs = 0;
+  for (size_t i = 0; i < len; i += 2) {
+    uint16_t color = (frame[i] << 8) | frame[i + 1];
+    uint16_t color_old = (frame_old[i] << 8) | frame_old[i + 1];
+    uint8_t b_diff = abs((color & 0b11111) - (color_old & 0b11111));
+    uint8_t g_diff = abs(((color >> 5) & 0b111111) - ((color_old >> 5) & 0b111111));
+    uint8_t r_diff = abs(((color >> 11) & 0b11111) - ((color_old >> 11) & 0b11111));
+    if (b_diff > beta || (g_diff >> 1) > beta || r_diff > beta) {
+      num_diffs++;
+    }
+  }
+  return num_diffs;
+}
+
+int count_luma_diffs_scalar(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta)
+{
+  int num_diffs = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (abs(luma[i] - luma_old[i]) > beta) {
+      num_diffs++;
+    }
+  }
+  return num_diffs;
+}
+
+// Compares four 7-bit pixels per 32-bit word. (a | 0x80) - b leaves 128 + a - b in each byte
+// without borrowing from its neighbour, so the sign of a - b lands in bit 7 and the magnitude
+// in bits 0-6. Adding 127 - beta to the magnitude carries into bit 7 exactly when it is
+// greater than beta, again without touching the neighbouring byte.
+static int count_luma_diffs_swar(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta)
+{
+  const uint32_t high = 0x80808080;
+  const uint32_t low = 0x7F7F7F7F;
+  const uint32_t bias = (uint32_t) (MOTION_LUMA_MAX - beta) * 0x01010101;
+  int num_diffs = 0;
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    uint32_t a;
+    uint32_t b;
+    memcpy(&a, luma + i, 4);
+    memcpy(&b, luma_old + i, 4);
+    uint32_t a_minus_b = (a | high) - b;
+    uint32_t b_minus_a = (b | high) - a;
+    uint32_t changed = (a_minus_b & (((a_minus_b & low) + bias)))
+                     | (b_minus_a & (((b_minus_a & low) + bias)));
+    changed = (changed & high) >> 7;
+    num_diffs += (changed * 0x01010101) >> 24;
+  }
+  for (; i < len; i++) {
+    if (abs(luma[i] - luma_old[i]) > beta) {
+      num_diffs++;
+    }
+  }
+  return num_diffs;
+}
+
+#ifdef MOTION_USE_PIE
+// ESP32-S3 PIE kernels, 16 pixels per instruction. Planes must be 16-byte aligned. q6 and q7
+// hold beta and -beta in every lane, and each lane of q5 counts the changed pixels it has seen.
+static void pie_load_beta(int beta)
+{
+  int8_t beta_vec[16] __attribute__((aligned(16)));
+  int8_t neg_beta_vec[16] __attribute__((aligned(16)));
+  memset(beta_vec, beta, sizeof(beta_vec));
+  memset(neg_beta_vec, -beta, sizeof(neg_beta_vec));
+  asm volatile (
+    "ee.vld.128.ip q6, %0, 0\n"
+    "ee.vld.128.ip q7, %1, 0\n"
+    :: "r"(beta_vec), "r"(neg_beta_vec) : "memory");
+}
+
+static int pie_sum_lanes()
+{
+  int8_t lane_counts[16] __attribute__((aligned(16)));
+  asm volatile ("ee.vst.128.ip q5, %0, 0\n" :: "r"(lane_counts) : "memory");
+  int sum = 0;
+  for (int l = 0; l < 16; l++) {
+    sum += lane_counts[l];
+  }
+  return sum;
+}
+
+// Lanes saturate at 127, so they are summed every 127 vectors.
+static int count_luma_diffs_pie(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta)
+{
+  pie_load_beta(beta);
+  int num_diffs = 0;
+  size_t vectors = len / 16;
+  while (vectors > 0) {
+    size_t batch = vectors < 127 ? vectors : 127;
+    asm volatile ("ee.zero.q q5\n");
+    for (size_t v = 0; v < batch; v++) {
+      asm volatile (
+        "ee.vld.128.ip q0, %0, 16\n"
+        "ee.vld.128.ip q1, %1, 16\n"
+        "ee.vsubs.s8 q2, q0, q1\n"
+        "ee.vcmp.gt.s8 q3, q2, q6\n"
+        "ee.vcmp.lt.s8 q4, q2, q7\n"
+        "ee.orq q3, q3, q4\n"
+        "ee.vsubs.s8 q5, q5, q3\n"
+        : "+r"(luma), "+r"(luma_old) :: "memory");
+    }
+    num_diffs += pie_sum_lanes();
+    vectors -= batch;
+  }
+
+  size_t tail = len % 16;
+  if (tail > 0) {
+    num_diffs += count_luma_diffs_swar(luma, luma_old, tail, beta);
+  }
+  return num_diffs;
+}
+
+// Counts one 16 pixel wide cell with one vector per row, stepping a whole thumbnail row
+// between loads. Expects pie_load_beta() to have been called.
+static int count_cell_diffs_pie(const uint8_t *luma, const uint8_t *luma_old)
+{
+  const int stride = MOTION_THUMB_WIDTH;
+  asm volatile ("ee.zero.q q5\n");
+  for (int row = 0; row < MOTION_CELL_HEIGHT; row++) {
+    asm volatile (
+      "ee.vld.128.xp q0, %0, %2\n"
+      "ee.vld.128.xp q1, %1, %2\n"
+      "ee.vsubs.s8 q2, q0, q1\n"
+      "ee.vcmp.gt.s8 q3, q2, q6\n"
+      "ee.vcmp.lt.s8 q4, q2, q7\n"
+      "ee.orq q3, q3, q4\n"
+      "ee.vsubs.s8 q5, q5, q3\n"
+      : "+r"(luma), "+r"(luma_old) : "r"(stride) : "memory");
+  }
+  return pie_sum_lanes();
+}
+#endif
+
+int count_luma_diffs(const uint8_t *luma, const uint8_t *luma_old, size_t len, int beta)
+{
+  if (beta >= MOTION_LUMA_MAX) {
+    return 0;
+  }
+  if (beta < 0) {
+    beta = 0;
+  }
+#ifdef MOTION_USE_PIE
+  if ((((uintptr_t) luma | (uintptr_t) luma_old) & 15) == 0) {
+    return count_luma_diffs_pie(luma, luma_old, len, beta);
+  }
+#endif
+  return count_luma_diffs_swar(luma, luma_old, len, beta);
+}
+
+void count_cell_diffs(const uint8_t *luma, const uint8_t *luma_old, int beta, uint16_t *cell_diffs)
+{
+  if (beta >= MOTION_LUMA_MAX) {
+    memset(cell_diffs, 0, MOTION_GRID_CELLS * sizeof(uint16_t));
+    return;
+  }
+  if (beta < 0) {
+    beta = 0;
+  }
+#ifdef MOTION_USE_PIE
+  bool use_pie = MOTION_CELL_WIDTH == 16 && (((uintptr_t) luma | (uintptr_t) luma_old) & 15) == 0;
+  if (use_pie) {
+    pie_load_beta(beta);
+  }
+#endif
+  for (int cy = 0; cy < MOTION_GRID_ROWS; cy++) {
+    for (int cx = 0; cx < MOTION_GRID_COLS; cx++) {
+      size_t offset = cy * MOTION_CELL_HEIGHT * MOTION_THUMB_WIDTH + cx * MOTION_CELL_WIDTH;
+      const uint8_t *cell = luma + offset;
+      const uint8_t *cell_old = luma_old + offset;
+      int diffs = 0;
+#ifdef MOTION_USE_PIE
+      if (use_pie) {
+        cell_diffs[cy * MOTION_GRID_COLS + cx] = count_cell_diffs_pie(cell, cell_old);
+        continue;
+      }
+#endif
+      for (int row = 0; row < MOTION_CELL_HEIGHT; row++) {
+        diffs += count_luma_diffs_swar(cell + row * MOTION_THUMB_WIDTH, cell_old + row * MOTION_THUMB_WIDTH, MOTION_CELL_WIDTH, beta);
+      }
+      cell_diffs[cy * MOTION_GRID_COLS + cx] = diffs;
+    }
+  }
+}
+
+// Exponential moving average in 8.8 fixed point. Differences are at most 127 << 8, so the
+// product with the rate stays well inside 32 bits.
+void update_background(uint16_t *background, uint8_t *background_luma, const uint8_t *luma, size_t len, int rate)
+{
+  if (rate >= MOTION_RATE_ONE) {
+    for (size_t i = 0; i < len; i++) {
+      background[i] = luma[i] << 8;
+    }
+    memcpy(background_luma, luma, len);
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    int diff = (luma[i] << 8) - background[i];
+    uint16_t bg = background[i] + ((diff * rate) >> 8);
+    background[i] = bg;
+    background_luma[i] = (bg + 128) >> 8;
+  }
+}
@@ -0,0 +1,120 @@
+#include "motion.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+// Gains outside this range are not a lighting change anyone could fit
+#define LIGHTING_MIN_GAIN 0.25f
+#define LIGHTING_MAX_GAIN 4.0f
+#define LIGHTING_FIT_ROUNDS 3
+
+static void cell_means(const uint8_t *luma, float *means)
+{
+  for (int cy = 0; cy < MOTION_GRID_ROWS; cy++) {
+    for (int cx = 0; cx < MOTION_GRID_COLS; cx++) {
+      const uint8_t *cell = luma + cy * MOTION_CELL_HEIGHT * MOTION_THUMB_WIDTH + cx * MOTION_CELL_WIDTH;
+      int sum = 0;
+      for (int y = 0; y < MOTION_CELL_HEIGHT; y++) {
+        for (int x = 0; x < MOTION_CELL_WIDTH; x++) {
+          sum += cell[y * MOTION_THUMB_WIDTH + x];
+        }
+      }
+      means[cy * MOTION_GRID_COLS + cx] = (float) sum / MOTION_CELL_PIXELS;
+    }
+  }
+}
+
+// Least squares fit of y = gain * x + offset over the used cells. A reference with almost no
+// contrast can't pin down a gain, so only the offset is fit.
+static void fit_line(const float *x, const float *y, const bool *used, float *gain, float *offset)
+{
+  int n = 0;
+  float sx = 0;
+  float sy = 0;
+  float sxx = 0;
+  float sxy = 0;
+  for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+    if (used[c]) {
+      n++;
+      sx += x[c];
+      sy += y[c];
+      sxx += x[c] * x[c];
+      sxy += x[c] * y[c];
+    }
+  }
+  *gain = 1;
+  *offset = 0;
+  if (n == 0) {
+    return;
+  }
+  float variance = n * sxx - sx * sx;
+  if (n < 2 || variance < 4.0f * n * n) {
+    *offset = (sy - sx) / n;
+    return;
+  }
+  *gain = (n * sxy - sx * sy) / variance;
+  *gain = *gain < LIGHTING_MIN_GAIN ? LIGHTING_MIN_GAIN : (*gain > LIGHTING_MAX_GAIN ? LIGHTING_MAX_GAIN : *gain);
+  *offset = (sy - *gain * sx) / n;
+}
+
+void fit_lighting(const motion_config &config, const uint8_t *luma, const uint8_t *luma_old, int *gain, int *offset)
+{
+  float x[MOTION_GRID_CELLS];
+  float y[MOTION_GRID_CELLS];
+  bool used[MOTION_GRID_CELLS];
+  cell_means(luma_old, x);
+  cell_means(luma, y);
+  for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+    used[c] = config.cell_included[c];
+  }
+
+  // Cells with local motion pull the least squares fit towards them, so the fit is repeated
+  // without the cells furthest from it, down to half of beta
+  float g;
+  float o;
+  fit_line(x, y, used, &g, &o);
+  float min_limit = config.beta > 2 ? config.beta / 2.0f : 1.0f;
+  for (int round = 0; round < LIGHTING_FIT_ROUNDS; round++) {
+    float residuals[MOTION_GRID_CELLS];
+    int n = 0;
+    for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+      if (used[c]) {
+        residuals[n++] = fabsf(y[c] - (g * x[c] + o));
+      }
+    }
+    if (n < MOTION_GRID_CELLS / 4) {
+      break;
+    }
+    // three times the median residual
+    std::nth_element(residuals, residuals + n / 2, residuals + n);
+    float limit = 3 * residuals[n / 2];
+    limit = limit < min_limit ? min_limit : limit;
+    bool dropped = false;
+    for (int c = 0; c < MOTION_GRID_CELLS; c++) {
+      if (used[c] && fabsf(y[c] - (g * x[c] + o)) > limit) {
+        used[c] = false;
+        dropped = true;
+      }
+    }
+    if (!dropped) {
+      break;
+    }
+    fit_line(x, y, used, &g, &o);
+  }
+
+  *gain = lroundf(g * MOTION_GAIN_ONE);
+  *offset = lroundf(o);
+}
+
+void normalize_lighting(const uint8_t *luma, uint8_t *normalized, size_t len, int gain, int offset)
+{
+  uint8_t lut[MOTION_LUMA_MAX + 1];
+  for (int v = 0; v <= MOTION_LUMA_MAX; v++) {
+    int mapped = ((v - offset) * MOTION_GAIN_ONE + gain / 2) / gain;
+    lut[v] = mapped < 0 ? 0 : (mapped > MOTION_LUMA_MAX ? MOTION_LUMA_MAX : mapped);
+  }
+  for (size_t i = 0; i < len; i++) {
+    normalized[i] = lut[luma[i]];
+  }
+}
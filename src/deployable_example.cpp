@@ -29,8 +29,13 @@ SOFTWARE.
 #include "WiFi.h"
 #include <esp_camera.h>
 #include <time.h>
+#include <esp_timer.h>
 #include "ArduinoJson.h"
 #include "groundlight.h"
+#include "motion.h"
+#include "jpeg_crop.h"
+#include "frame_score.h"
+#include "poll_schedule.h"
 
 #include "camera_pins.h" // thank you seeedstudio for this file
 #include "integrations.h"
@@ -51,14 +56,6 @@ SOFTWARE.
   #define RESET_SETTINGS_GPIO_DEFAULT HIGH
 #endif
 
-#define FRAME_ARR_LEN 1280 * 1024 * 2 / 64
-#define COLOR_VAL_MAX 31
-uint8_t *frame_565;
-uint8_t *frame_565_old;
-#define ALPHA_DIVISOR 10
-#define ALPHA FRAME_ARR_LEN / ALPHA_DIVISOR
-#define BETA 20 // out of 31
-
 enum QueryState {
   WAITING_TO_QUERY,
   DNS_NOT_FOUND,
@@ -128,13 +125,166 @@ String stacklightStateToString (StacklightState state) {
   }
 }
 
+enum MotionState {
+  MOTION_NOT_CHECKED,
+  LAST_FRAME_MOTION,
+  LAST_FRAME_NO_MOTION,
+  LAST_FRAME_LIGHTING_CHANGE,
+};
+
+String motionStateToString (MotionState state) {
+  switch (state) {
+    case MOTION_NOT_CHECKED:
+      return "MOTION_NOT_CHECKED";
+    case LAST_FRAME_MOTION:
+      return "LAST_FRAME_MOTION";
+    case LAST_FRAME_NO_MOTION:
+      return "LAST_FRAME_NO_MOTION";
+    case LAST_FRAME_LIGHTING_CHANGE:
+      return "LAST_FRAME_LIGHTING_CHANGE";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+enum LongPollState {
+  LONG_POLL_UNKNOWN,
+  LONG_POLL_SUPPORTED,
+  LONG_POLL_UNSUPPORTED,
+};
+
+String longPollStateToString (LongPollState state) {
+  switch (state) {
+    case LONG_POLL_UNKNOWN:
+      return "LONG_POLL_UNKNOWN";
+    case LONG_POLL_SUPPORTED:
+      return "LONG_POLL_SUPPORTED";
+    case LONG_POLL_UNSUPPORTED:
+      return "LONG_POLL_UNSUPPORTED";
+    default:
+      return "UNKNOWN";
+  }
+}
+
 QueryState queryState = WAITING_TO_QUERY;
 NotificationState notificationState = NOTIFICATION_NOT_ATTEMPTED;
 StacklightState stacklightState = STACKLIGHT_NOT_FOUND;
+MotionState motionState = MOTION_NOT_CHECKED;
+int lighting_changes = 0;
+// Whether the server holds image queries for a confident answer when asked to. Kept through
+// deep sleep so a wake doesn't have to find out again, and cleared on any other reset.
+RTC_DATA_ATTR LongPollState longPollState = LONG_POLL_UNKNOWN;
+
+// Settings of the motion monitor task, which checks for motion between image queries and wakes
+// loop() for an immediate query. Guarded by camera_mutex.
+struct motion_monitor_settings {
+  bool enabled;
+  int period_ms;          // time between monitor frames
+  int debounce_frames;    // consecutive frames with motion needed to trigger a query
+  int min_interval_ms;    // minimum time between queries triggered by the monitor
+  bool crop;              // record the region with motion for crop_to_motion
+  int crop_padding;
+  int crop_min_size;
+  motion_config config;
+};
+
+#define MOTION_MONITOR_MAX_FPS 10
+
+// loop() and the motion monitor share the camera and the motion reference. loop() holds the
+// mutex from its capture until the frame is returned, and the monitor skips frames meanwhile.
+SemaphoreHandle_t camera_mutex = NULL;
+TaskHandle_t loop_task = NULL;
+TaskHandle_t motion_monitor_task = NULL;
+motion_monitor_settings monitor_settings = { false, 1000 };
+volatile bool monitor_settings_changed = true;
+volatile unsigned long motion_trigger_time = 0;   // millis() when the monitor last triggered
+
+// Frames waiting for the network task in pipeline mode. The capture side copies every frame to
+// be queried (or its crop) into PSRAM, so camera buffers are returned right away.
+struct query_job {
+  uint8_t *buf;
+  size_t len;
+  int width;
+  int height;
+  unsigned long captured_at;  // millis()
+};
+
+#define PIPELINE_MAX_DEPTH 4
+
+QueueHandle_t query_queue = NULL;   // NULL unless pipeline mode is on
+bool pipeline_backpressure = false; // when full: wait for the network task instead of dropping the oldest frame
+int pipeline_dropped = 0;
+
+// Preferences is one shared handle, so loop(), the network task and the serial listener take
+// turns opening it
+SemaphoreHandle_t preferences_mutex = NULL;
+
+// Region with motion in the last frame that had motion, which is uploaded instead of the whole
+// frame when cropping is on. Guarded by camera_mutex.
+motion_box motion_crop_region;
+bool motion_crop_valid = false;
 
 camera_fb_t *frame = NULL;
+// With more than one frame buffer the camera driver keeps the newest complete frame (grab
+// latest), otherwise it holds on to the oldest one until it's returned
+int camera_frame_buffers = 1;
+int last_capture_ms = 0;    // time loop() waited for its last frame
+int last_frame_age_ms = 0;  // age of that frame when it was handed out
+
+// Burst capture: loop() takes up to burst_frames frames per image query and uploads the one
+// with the best sharpness and exposure score, until capturing and scoring have taken
+// burst_budget_ms. Needs two frame buffers, since the best frame is held while the next one
+// is captured.
+#define BURST_MAX_FRAMES 8
+int last_burst_frames = 0;    // frames captured for the last image query
+int last_burst_score_us = 0;  // time spent scoring them
+
+// Auto exposure takes a few frames to settle after the flash turns on or the camera starts.
+// Instead of a fixed delay, frames are taken until their mean brightness holds still, up to
+// WARM_UP_MAX_MS.
+#define WARM_UP_MAX_MS 1000
+#define WARM_UP_TOLERANCE 2       // drift in mean luma (out of MOTION_LUMA_MAX) that counts as settled
+#define WARM_UP_STABLE_FRAMES 2   // frames in a row within the tolerance of the frame starting the run
+bool camera_needs_warm_up = true; // the first frames after the camera starts are badly exposed
+int last_warm_up_ms = 0;
+
+// Camera recovery: a failed camera init or capture first reinitializes only the camera driver,
+// up to CAMERA_RECOVERY_ATTEMPTS times, and only restarts the system when every attempt failed.
+#define CAMERA_RECOVERY_ATTEMPTS 3
+#define CAMERA_RECOVERY_MAGIC 0x43414D31 // "CAM1"
+
+struct camera_recovery_counters {
+  uint32_t magic;
+  uint32_t reinits;         // driver reinitializations that brought the camera back
+  uint32_t failed_reinits;  // reinitializations that failed
+  uint32_t restarts;        // system restarts after every reinitialization failed
+};
+
+// Not initialized on any reset so the counters outlive the restarts they count. They are
+// cleared on power on, and validated with the magic.
+RTC_NOINIT_ATTR camera_recovery_counters camera_recoveries;
+camera_config_t camera_config;
+
+// What the camera uploads for the detector. The frame size and grayscale are set when the
+// camera starts. With an upload budget the JPEG quality is tuned after every image query,
+// between min_quality and max_quality.
+struct image_profile {
+  framesize_t frame_size;
+  int quality;          // lower means higher quality
+  int min_quality;
+  int max_quality;
+  bool grayscale;
+  int target_bytes;     // upload size budget, 0 for none
+  int target_ms;        // upload time budget, 0 for none
+};
+
+image_profile imageProfile = { FRAMESIZE_SXGA, 10, 10, 10, false, 0, 0 };
+volatile int jpeg_quality = 10;   // set by the controller, applied before the next capture
+int applied_jpeg_quality = 10;
+float upload_bytes_per_ms = 0;    // measured upload throughput, smoothed over queries
 int *last_frame_buffer = NULL;
 char groundlight_endpoint[60] = "api.groundlight.ai";
+GroundlightClient groundlight_client;   // one connection for an image query and its polls
 
 Preferences preferences;
 
@@ -173,21 +323,131 @@ bool disable_deep_sleep_for_notifications = false;
 bool disable_deep_sleep_until_reset = true;
 float targetConfidence = 0.9;
 int retryLimit = 10;
+int longPollWait = 10;     // seconds the server is asked to hold a request for a confident answer, 0 to poll
+
+// How the firmware polls for a confident answer when the server doesn't hold requests: the first
+// poll after initial_ms, each delay after that multiplier times the last up to max_ms, and a
+// jitter fraction of every delay random so devices don't poll in step.
+struct poll_settings {
+  unsigned long initial_ms;
+  float multiplier;
+  unsigned long max_ms;
+  float jitter;
+};
+
+poll_settings pollSettings = { 1000, 1.25, 3000, 0.25 };
+
+#define POLL_MIN_DELAY_MS 100
+
+// Polling settings brought into a range that can't flood the API: a first delay of at least
+// POLL_MIN_DELAY_MS, a cap no lower than that, delays that don't shrink and jitter from 0 to 1
+poll_settings make_poll_settings(int initial_ms, float multiplier, int max_ms, float jitter) {
+  initial_ms = max(initial_ms, POLL_MIN_DELAY_MS);
+  return { (unsigned long) initial_ms, max(multiplier, 1.0f), (unsigned long) max(max_ms, initial_ms), constrain(jitter, 0.0f, 1.0f) };
+}
+
+// Polls made for the answers to image queries, for the state query
+int last_answer_polls = 0;
+int answers_polled = 0;
+long answer_polls = 0;
 
 String queryResults = "NONE_YET";
 String queryID = "NONE_YET";
 char last_label[30] = "NONE_YET";
 bool wifi_configured = false;
+bool wifi_started = false;
 
 String input = "";
 int last_upload_time = 0;
+bool woke_from_sleep = false;
+
+// WiFi details kept across deep sleep, so a wake can join the access point without scanning,
+// skip DHCP and skip looking up the endpoint. Each part expires on its own, and the full scan,
+// DHCP and lookup take over whenever a cached part doesn't work.
+#define WIFI_CACHE_AP_TTL_S 3600      // access point BSSID and channel
+#define WIFI_CACHE_LEASE_TTL_S 3600   // DHCP lease, reused as a static config
+#define WIFI_CACHE_DNS_TTL_S 600      // endpoint address
+#define WIFI_CACHE_CONNECT_MS 3000    // time to connect with the cached details before scanning
+
+struct wifi_cache {
+  char ssid[33];              // network the details belong to
+  uint8_t bssid[6];
+  int32_t channel;
+  time_t ap_saved_at;         // 0 if there is no access point cached
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  time_t lease_saved_at;      // 0 if there is no lease cached
+  char endpoint[60];
+  uint32_t endpoint_address;
+  time_t endpoint_saved_at;   // 0 if there is no address cached
+};
+
+// Kept through deep sleep and cleared on any other reset. Ages are taken from the system
+// clock, which keeps running through deep sleep.
+RTC_DATA_ATTR wifi_cache wifiCache = { 0 };
+// The TLS session of the last connection to the Groundlight endpoint, so the first connection
+// after a wake can resume it instead of making a full handshake. Sessions that don't fit, such
+// as ones that keep a large server certificate, aren't kept. 0 turns this off.
+#ifndef TLS_SESSION_RTC_SIZE
+#define TLS_SESSION_RTC_SIZE 2048
+#endif
+#define TLS_SESSION_TTL_S 3600        // servers expire their tickets, a stale one costs a round trip
+
+#if TLS_SESSION_RTC_SIZE > 0
+struct tls_session_cache {
+  char host[64];
+  time_t saved_at;            // 0 if there is no session cached
+  uint16_t len;
+  uint8_t data[TLS_SESSION_RTC_SIZE];
+};
+
+RTC_DATA_ATTR tls_session_cache tlsSessionCache = { 0 };
+#endif
+bool tls_session_restored = false;
+
+bool wifi_from_cache = false;       // connecting to the cached access point
+bool wifi_lease_cached = false;     // using the cached lease instead of DHCP
+bool wifi_cache_saved = false;
+unsigned long wifi_begin_time = 0;
+
+// Pre-connect: while loop() captures and checks a frame, a task on the protocol core connects
+// to Groundlight, so the TLS handshake is done by the time there is an image to upload.
+// Guarded by the task running: loop() waits for it before uploading or cancelling.
+TaskHandle_t preconnect_task = NULL;      // NULL when no pre-connect is running
+SemaphoreHandle_t preconnect_done = NULL;
+volatile bool preconnect_cancelled = false;
+
+// Static IP config from additional_config.static_ip, all 0.0.0.0 for DHCP
+IPAddress static_ip;
+IPAddress static_gateway;
+IPAddress static_subnet;
+IPAddress static_dns;
+
+// When each phase of this boot finished, in milliseconds since boot, 0 until it has. Printed
+// after the first image query to show where wake to upload time goes.
+struct boot_timing {
+  unsigned long setup_start;
+  unsigned long camera_ready;
+  unsigned long setup_done;
+  unsigned long first_capture;
+  unsigned long wifi_connected;
+  unsigned long first_upload;
+};
+
+boot_timing bootTiming = { 0 };
 int last_print_time = 0;
 char input2[1000];
 int input2_index = 0;
 bool new_data = false;
 
 StaticJsonDocument<1024> resultDoc;
-StaticJsonDocument<1024> synthesisDoc;
+
+// Sizes of the replies to the serial config and state queries. The state reply also copies the
+// last query response, which its document gets room for on top.
+#define CONFIG_DOC_SIZE 4096
+#define STATE_DOC_SIZE 2048
 
 #ifdef NEOPIXEL_PIN
   Adafruit_NeoPixel pixels(NEOPIXEL_COUNT, NEOPIXEL_PIN, NEO_GRB + NEO_KHZ800);
@@ -237,7 +497,28 @@ void listener(void * parameter);
 
 bool try_save_config(char * input);
 void try_answer_query(String input);
-bool is_motion_detected(camera_fb_t* frame, int alpha, int beta);
+void load_motion_config(motion_config *config);
+bool motion_calibration_due();
+bool calibrate_motion();
+bool crop_to_motion(camera_fb_t *fb, camera_fb_t *crop);
+camera_fb_t *capture_fresh_frame();
+void apply_sensor_settings();
+bool recover_camera();
+void restart_for_camera();
+void warm_up_exposure();
+camera_fb_t *capture_best_frame(int frames, int budget_ms);
+void load_image_profile(image_profile *profile);
+void tune_jpeg_quality();
+void set_query_results(const String &response, const String &id);
+bool run_image_query(camera_fb_t *fb, camera_fb_t *notify_fb);
+bool copy_query_job(camera_fb_t *fb, query_job *job);
+void queue_query_job(query_job *job);
+void networkTask(void * parameter);
+void load_motion_monitor_settings();
+void motionMonitorTask(void * parameter);
+void start_preconnect();
+void finish_preconnect(bool upload);
+void preconnectTask(void * parameter);
 
 void printInfo();
 int consecutive_pass_limit = 3;
@@ -249,13 +530,172 @@ bool notifyStacklight(const char * label);
 bool decodeWorkingHoursString(String working_hours);
 
 
+bool wifi_cache_fresh(time_t saved_at, int ttl_s) {
+  time_t now = time(NULL);
+  return saved_at != 0 && now >= saved_at && now - saved_at < ttl_s;
+}
+
+// Starts connecting to the configured WiFi network, unless that already happened. A cached
+// access point is joined directly by BSSID and channel, and a cached lease is set as a static
+// config so there is no DHCP exchange.
+void start_wifi() {
+  if (!wifi_started) {
+    bool cached_ap = strcmp(wifiCache.ssid, ssid) == 0 && wifi_cache_fresh(wifiCache.ap_saved_at, WIFI_CACHE_AP_TTL_S);
+    if ((uint32_t) static_ip != 0) {
+      WiFi.config(static_ip, static_gateway, static_subnet, static_dns);
+    } else if (cached_ap && wifi_cache_fresh(wifiCache.lease_saved_at, WIFI_CACHE_LEASE_TTL_S)) {
+      WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+      wifi_lease_cached = true;
+    }
+    if (cached_ap) {
+      WiFi.begin(ssid, password, wifiCache.channel, wifiCache.bssid);
+      wifi_from_cache = true;
+    } else {
+      WiFi.begin(ssid, password);
+    }
+    wifi_started = true;
+    wifi_begin_time = millis();
+  }
+}
+
+// Drops the cached access point and lease after they failed to connect, and connects the
+// regular way with a scan and DHCP
+void wifi_cache_failed() {
+  debug_printf("Couldn't connect with the cached WiFi details, scanning for %s\n", ssid);
+  wifiCache.ap_saved_at = 0;
+  wifiCache.lease_saved_at = 0;
+  wifi_from_cache = false;
+  WiFi.disconnect();
+  if (wifi_lease_cached) {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    wifi_lease_cached = false;
+  }
+  WiFi.begin(ssid, password);
+}
+
+// Caches the access point after connecting, and the lease if it came from DHCP. A reused
+// lease keeps its original age, so it's handed back to DHCP after WIFI_CACHE_LEASE_TTL_S.
+void save_wifi_cache() {
+  time_t now = time(NULL);
+  strncpy(wifiCache.ssid, ssid, sizeof(wifiCache.ssid) - 1);
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ap_saved_at = now;
+  if ((uint32_t) static_ip == 0 && !wifi_lease_cached) {
+    wifiCache.ip = WiFi.localIP();
+    wifiCache.gateway = WiFi.gatewayIP();
+    wifiCache.subnet = WiFi.subnetMask();
+    wifiCache.dns = WiFi.dnsIP();
+    wifiCache.lease_saved_at = now;
+  }
+  wifi_cache_saved = true;
+}
+
+// Hands the cached endpoint address to the Groundlight library while it's fresh, and has the
+// library look the endpoint up once it's stale. Returns whether the cached address is used.
+bool use_cached_endpoint_address() {
+  bool fresh = strcmp(wifiCache.endpoint, groundlight_endpoint) == 0
+    && wifi_cache_fresh(wifiCache.endpoint_saved_at, WIFI_CACHE_DNS_TTL_S);
+  set_endpoint_address(groundlight_endpoint, fresh ? IPAddress(wifiCache.endpoint_address) : IPAddress());
+  return fresh;
+}
+
+// Caches the endpoint address the library looked up, if it did
+void save_endpoint_address(bool was_cached) {
+  uint32_t address = get_endpoint_address(groundlight_endpoint);
+  if (address != 0 && (!was_cached || address != wifiCache.endpoint_address)) {
+    strncpy(wifiCache.endpoint, groundlight_endpoint, sizeof(wifiCache.endpoint) - 1);
+    wifiCache.endpoint_address = address;
+    wifiCache.endpoint_saved_at = time(NULL);
+  }
+}
+
+// Hands the TLS session cached before deep sleep to the Groundlight library, once per boot
+void restore_tls_session() {
+#if TLS_SESSION_RTC_SIZE > 0
+  if (tls_session_restored) {
+    return;
+  }
+  tls_session_restored = true;
+  String host = get_endpoint_host(groundlight_endpoint);
+  if (woke_from_sleep && strcmp(tlsSessionCache.host, host.c_str()) == 0
+      && wifi_cache_fresh(tlsSessionCache.saved_at, TLS_SESSION_TTL_S)
+      && !load_tls_session(host.c_str(), tlsSessionCache.data, tlsSessionCache.len)) {
+    debug_println("Couldn't restore the cached TLS session");
+  }
+#endif
+}
+
+// Keeps the session of the last connection to the Groundlight endpoint through deep sleep
+void save_tls_session_for_sleep() {
+#if TLS_SESSION_RTC_SIZE > 0
+  String host = get_endpoint_host(groundlight_endpoint);
+  size_t len = save_tls_session(host.c_str(), tlsSessionCache.data, sizeof(tlsSessionCache.data));
+  tlsSessionCache.saved_at = len > 0 ? time(NULL) : 0;
+  tlsSessionCache.len = len;
+  strncpy(tlsSessionCache.host, host.c_str(), sizeof(tlsSessionCache.host) - 1);
+#endif
+}
+
+// Seconds to ask the server to hold the next request of an image query for, so it isn't held
+// past the retry limit. 0 once the server has shown it doesn't hold requests.
+int long_poll_wait(unsigned long waited_ms) {
+  if (longPollWait <= 0 || longPollState == LONG_POLL_UNSUPPORTED) {
+    return 0;
+  }
+  return max(0, min(longPollWait, retryLimit - (int) (waited_ms / 1000)));
+}
+
+// Learns from a request made with wait_s whether the server holds requests. An answer it had no
+// reason to give yet, below both the target and the detector's own confidence threshold, that
+// came back well before the wait was up shows it doesn't.
+void check_long_poll(int wait_s, unsigned long response_ms, const String &results) {
+  if (wait_s <= 0 || get_query_id(results) == "NONE") {
+    return;
+  }
+  float confidence = get_query_confidence(results);
+  float threshold = get_query_confidence_threshold(results);
+  if (confidence >= targetConfidence || (threshold > 0 && confidence >= threshold)) {
+    return;
+  }
+  if (response_ms < wait_s * 1000UL / 2) {
+    if (longPollState != LONG_POLL_UNSUPPORTED) {
+      debug_println("The server doesn't hold requests for an answer, polling instead");
+    }
+    longPollState = LONG_POLL_UNSUPPORTED;
+  } else {
+    longPollState = LONG_POLL_SUPPORTED;
+  }
+}
+
 bool should_deep_sleep() {
-  return (query_delay > 29) && !disable_deep_sleep_for_notifications && !disable_deep_sleep_until_reset;
-} 
+  return (query_delay > 29) && !disable_deep_sleep_for_notifications && !disable_deep_sleep_until_reset && !monitor_settings.enabled
+    && query_queue == NULL;
+}
+
+void lock_camera() {
+  xSemaphoreTake(camera_mutex, portMAX_DELAY);
+}
+
+void unlock_camera() {
+  xSemaphoreGive(camera_mutex);
+}
+
+void lock_preferences() {
+  xSemaphoreTake(preferences_mutex, portMAX_DELAY);
+}
+
+void unlock_preferences() {
+  xSemaphoreGive(preferences_mutex);
+}
 
 void deep_sleep() {
-  int time_elapsed = millis() - last_upload_time;
-  int time_to_sleep = (query_delay - 10) * 1000000 - (1000 * time_elapsed);
+  // after a wake the cycle started when the board booted, so the boot counts towards it
+  int time_elapsed = millis() - (woke_from_sleep ? 0 : last_upload_time);
+  int time_to_sleep = max(query_delay * 1000 - time_elapsed, 1000) * 1000;
+  // keep the motion reference for the next wake
+  motion_save_reference();
+  save_tls_session_for_sleep();
   debug_printf("Entering deep sleep for %d seconds\n", time_to_sleep / 1000000);
   esp_sleep_enable_timer_wakeup(time_to_sleep);
   esp_deep_sleep_start();
@@ -445,14 +885,18 @@ void performAutoConfig(AsyncWebServerRequest *request){
 
 void setup() {
 
+  bootTiming.setup_start = millis();
   Serial.begin(115200);
   Serial.println("Groundlight ESP32CAM waking up...");
- 
- 
-  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
-    Serial.println("Wakeup from deep sleep.  forcing restart to properly reset wifi module");
-    ESP.restart();
+
+  // Deep sleep powers the radio down, so a wake starts the WiFi driver from scratch just like
+  // a restart would. The driver is kept from saving the network to its own flash config and
+  // reconnecting to it on its own, so the only connection is the one start_wifi() makes.
+  woke_from_sleep = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+  if (woke_from_sleep) {
+    Serial.println("Wakeup from deep sleep");
   }
+  WiFi.persistent(false);
 
 #if defined(GPIO_LED_FLASH)
   pinMode(GPIO_LED_FLASH, OUTPUT);
@@ -470,6 +914,11 @@ void setup() {
   
   debug_printf("Firmware : %s built on %s at %s\n", NAME, __DATE__, __TIME__);
 
+  camera_mutex = xSemaphoreCreateMutex();
+  preferences_mutex = xSemaphoreCreateMutex();
+  preconnect_done = xSemaphoreCreateBinary();
+  loop_task = xTaskGetCurrentTaskHandle(); // setup() and loop() run in the same task
+
   xTaskCreate(
     listener,         // Function that should be called
     "Uart Listener",  // Name of the task (for debugging)
@@ -592,9 +1041,17 @@ void setup() {
     preferences.getString("api_key", groundlight_API_key, 75);
     preferences.getString("det_id", groundlight_det_id, 100);
     query_delay = preferences.getInt("query_delay", query_delay);
-    
-    WiFi.begin(ssid, password);
+    static_ip.fromString(preferences.getString("ip_addr", ""));
+    static_gateway.fromString(preferences.getString("ip_gw", ""));
+    static_subnet.fromString(preferences.getString("ip_mask", ""));
+    static_dns.fromString(preferences.getString("ip_dns", ""));
+
     wifi_configured = true;
+    // with motion detection WiFi waits for the first frame with motion, so waking from deep
+    // sleep to a still scene never powers up the radio
+    if (!preferences.getBool("motion", false)) {
+      start_wifi();
+    }
   }
 #ifdef ENABLE_STACKLIGHT
   if (preferences.isKey("ssid") && preferences.isKey("sl_uuid") && !preferences.isKey("sl_ip")) {
@@ -622,6 +1079,7 @@ void setup() {
       debug_printf("Could not find stacklight : %s\n", preferences.getString("sl_uuid", "").c_str());
     }
     WiFi.begin(ssid, password);
+    wifi_started = true;
   }
 #endif
 
@@ -634,6 +1092,11 @@ void setup() {
   if (preferences.isKey("waitTime")) {
     retryLimit = preferences.getInt("waitTime", retryLimit);
   }
+  longPollWait = preferences.getInt("lp_wait", longPollWait);
+  pollSettings = make_poll_settings(preferences.getInt("poll_init", pollSettings.initial_ms),
+                                    preferences.getFloat("poll_mult", pollSettings.multiplier),
+                                    preferences.getInt("poll_max", pollSettings.max_ms),
+                                    preferences.getFloat("poll_jit", pollSettings.jitter));
   if (preferences.isKey("det_name")) {
     preferences.getString("det_name", groundlight_det_name, 100);
   }
@@ -665,35 +1128,73 @@ void setup() {
   config.pixel_format = PIXFORMAT_JPEG;
 
   // Photo Quality Settings
-  // config.frame_size = FRAMESIZE_UXGA; // See here for a list of options and resolutions: https://github.com/espressif/esp32-camera/blob/master/driver/include/sensor.h#L84
-  config.frame_size = FRAMESIZE_SXGA; // See here for a list of options and resolutions: https://github.com/espressif/esp32-camera/blob/master/driver/include/sensor.h#L84
-  config.jpeg_quality = 10;           // lower means higher quality
-  config.fb_count = 1;
+  preferences.begin("config", true);
+  load_image_profile(&imageProfile);
+  // the motion thumbnail is read from SXGA frames
+  if (preferences.getBool("motion", false) && imageProfile.frame_size != FRAMESIZE_SXGA) {
+    debug_printf("Motion detection needs SXGA frames, ignoring the image profile's frame size\n");
+    imageProfile.frame_size = FRAMESIZE_SXGA;
+  }
+  config.frame_size = imageProfile.frame_size; // See here for a list of options and resolutions: https://github.com/espressif/esp32-camera/blob/master/driver/include/sensor.h#L84
+  config.jpeg_quality = imageProfile.quality;  // lower means higher quality
+  jpeg_quality = imageProfile.quality;
+  applied_jpeg_quality = imageProfile.quality;
+  camera_frame_buffers = psramFound() ? preferences.getInt("fb_count", 2) : 1;
+  preferences.end();
+  camera_frame_buffers = max(1, min(camera_frame_buffers, 3));
+  config.fb_count = camera_frame_buffers;
+  config.fb_location = psramFound() ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+  config.grab_mode = camera_frame_buffers > 1 ? CAMERA_GRAB_LATEST : CAMERA_GRAB_WHEN_EMPTY;
 
-  esp_err_t error_code = esp_camera_init(&config);
+  esp_reset_reason_t reset_reason = esp_reset_reason();
+  if (camera_recoveries.magic != CAMERA_RECOVERY_MAGIC || reset_reason == ESP_RST_POWERON || reset_reason == ESP_RST_BROWNOUT) {
+    camera_recoveries = { CAMERA_RECOVERY_MAGIC, 0, 0, 0 };
+  }
+
+  camera_config = config;
+  esp_err_t error_code = esp_camera_init(&camera_config);
   if (error_code != ESP_OK)
   {
     debug_printf("Camera initialization failed with error code: %s\n", esp_err_to_name(error_code));
-    debug_printf("Restarting system in 3 seconds!\n");
+    // some boards are less reliable for initialization and will eventually just start working
+    if (!recover_camera()) {
+      restart_for_camera();
+      return;
+    }
+  } else {
+    apply_sensor_settings();
+  }
+  bootTiming.camera_ready = millis();
 
-    delay(3000);
-    ESP.restart(); // some boards are less reliable for initialization and will everntually just start working
-    return;
+  // alloc memory for motion detection thumbnails
+  if (!motion_begin()) {
+    debug_printf("Failed to allocate motion detection buffers!\n");
+  } else if (motion_restore_reference()) {
+    debug_printf("Restored motion reference from before deep sleep\n");
   }
 
-  sensor_t * s = esp_camera_sensor_get();
-  preferences.begin("config", false);
-  if (!preferences.getBool("img_rotate", false)) s->set_vflip(s, 1);
-  if (preferences.getBool("img_mirror", false)) s->set_hmirror(s, 1);
+  preferences.begin("config", true);
+  int pipeline_depth = psramFound() ? min(preferences.getInt("pl_depth", 0), PIPELINE_MAX_DEPTH) : 0;
+  pipeline_backpressure = preferences.getBool("pl_block", false);
   preferences.end();
-
-  // alloc memory for 565 frames
-  frame_565 = (uint8_t *) ps_malloc(FRAME_ARR_LEN);
-  frame_565_old = (uint8_t *) ps_malloc(FRAME_ARR_LEN);
+  if (pipeline_depth > 0) {
+    query_queue = xQueueCreate(pipeline_depth, sizeof(query_job));
+    xTaskCreatePinnedToCore(
+      networkTask,          // Function that should be called
+      "Network",            // Name of the task (for debugging)
+      12288,                // Stack size (bytes)
+      NULL,                 // Parameter to pass
+      1,                    // Task priority
+      NULL,                 // Task handle
+      0                     // Core, the protocol core WiFi runs on, leaving the application core to capture
+    );
+    debug_printf("Pipelining image queries, up to %d waiting\n", pipeline_depth);
+  }
   
 #ifdef LED_BUILTIN
   digitalWrite(LED_BUILTIN, LOW);
 #endif
+  bootTiming.setup_done = millis();
 }
 
 
@@ -715,13 +1216,16 @@ void listener(void * parameter) {
     if (new_data_) {
       debug_println("New data");
       vTaskDelay(100 / portTICK_PERIOD_MS);
+      lock_preferences();
       if (((String) input3).indexOf("query") != -1 && ((String) input3).indexOf("ssid") == -1) {
         try_answer_query(input3);
       } else if(try_save_config(input3)) {
         debug_println("Saved config!");
         WiFi.begin(ssid, password);
         wifi_configured = true;
+        wifi_started = true;
       }
+      unlock_preferences();
       input = "";
       input3_index = 0;
       new_data_ = false;
@@ -743,17 +1247,18 @@ void loop () {
     last_print_time = millis();
   }
 
-    // normalize startup time to 10 seconds if we could be coming from sleep (delay is built into sleep delay)
-  if (should_deep_sleep()) {
-    int time = millis();
-    if (time < 10000) {
-      vTaskDelay((10000 - time) / portTICK_PERIOD_MS);
-    } else {
-      debug_printf("Startup (or wake-up from deep sleep) took more than 10s!\n");
-    }
+  if (monitor_settings_changed) {
+    load_motion_monitor_settings();
   }
 
-  if (millis() < last_upload_time + query_delay * 1000 && !should_deep_sleep()) {
+  if (monitor_settings.enabled) {
+    // the motion monitor replaces the query delay, wait for it to see motion
+    if (ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS) == 0) {
+      return;
+    }
+    debug_printf("Motion monitor triggered an image query\n");
+    last_upload_time = millis();
+  } else if (millis() < last_upload_time + query_delay * 1000 && !should_deep_sleep()) {
     return;
   } else {
     last_upload_time = millis();
@@ -761,11 +1266,16 @@ void loop () {
 
   debug_printf("Free heap size: %d\n", esp_get_free_heap_size());
 
+  lock_preferences();
   preferences.begin("config", true);
   if (preferences.isKey("wkhrs") && preferences.getString("wkhrs", "") != "") {
     debug_printf("Checking time of day vs. working hours configuration\n");
-    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
     struct tm timeinfo;
+    // the clock keeps running through deep sleep, so NTP (and WiFi) is only needed until it is set
+    if (!getLocalTime(&timeinfo, 0)) {
+      start_wifi();
+      configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+    }
     if (!getLocalTime(&timeinfo)){
       debug_println("Failed to obtain time");
     } else {
@@ -781,6 +1291,7 @@ void loop () {
         debug_println("Not in working hours!");
         last_upload_time = millis();
         preferences.end();
+        unlock_preferences();
         if (should_deep_sleep()) {
           deep_sleep();
         }
@@ -790,18 +1301,53 @@ void loop () {
   }
   preferences.end();
 
+  preferences.begin("config");
+  if (preferences.getBool("motion", false) && motion_calibration_due()) {
+    debug_println("Calibrating motion detection, keep the scene still...");
+    lock_camera();
+    if (!calibrate_motion()) {
+      debug_println("Motion calibration failed, the scene was not still");
+    }
+    unlock_camera();
+    monitor_settings_changed = true;
+  }
+  int burst_frames = max(1, min(preferences.getInt("burst_n", 1), BURST_MAX_FRAMES));
+  int burst_budget_ms = preferences.getInt("burst_ms", 500);
+  // the same test as the motion gate below
+  bool motion_gated = !monitor_settings.enabled && preferences.getBool("motion", false) && preferences.isKey("mot_a") && preferences.isKey("mot_b");
+  preferences.end();
+
+  if (!motion_gated) {
+    start_preconnect();
+  }
+
   debug_printf("Capturing image...");
 
   // get image from camera into a buffer
+  lock_camera();
+  if (jpeg_quality != applied_jpeg_quality) {
+    sensor_t * s = esp_camera_sensor_get();
+    s->set_quality(s, jpeg_quality);
+    applied_jpeg_quality = jpeg_quality;
+  }
   #if defined(GPIO_LED_FLASH)
     digitalWrite(GPIO_LED_FLASH, HIGH);
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    camera_needs_warm_up = true;
   #endif
-
-  frame = esp_camera_fb_get();
-  // Testing how to get the latest image
-  esp_camera_fb_return(frame);
-  frame = esp_camera_fb_get();
+  if (camera_needs_warm_up) {
+    warm_up_exposure();
+    camera_needs_warm_up = false;
+  }
+
+  frame = capture_best_frame(burst_frames, burst_budget_ms);
+  if (!frame) {
+    debug_printf("Camera capture failed!\n");
+    if (recover_camera()) {
+      warm_up_exposure();
+      camera_needs_warm_up = false;
+      frame = capture_best_frame(burst_frames, burst_budget_ms);
+    }
+  }
 
   #if defined(GPIO_LED_FLASH)
     digitalWrite(GPIO_LED_FLASH, LOW);
@@ -809,21 +1355,46 @@ void loop () {
 
   if (!frame)
   {
-    debug_printf("Camera capture failed! Restarting system in 3 seconds!\n");
-    delay(3000);
-    ESP.restart(); // some boards are less reliable for camera captures and will everntually just start working
+    restart_for_camera();
   }
 
   debug_printf("encoded size is %d bytes\n", frame->len);
+  if (!bootTiming.first_capture) {
+    bootTiming.first_capture = millis();
+  }
+  if (monitor_settings.enabled) {
+    debug_printf("Motion to capture latency: %lu ms\n", millis() - motion_trigger_time);
+  }
 
   preferences.begin("config");
-  if (preferences.isKey("motion") && preferences.getBool("motion") && preferences.isKey("mot_a") && preferences.isKey("mot_b")) {
-    int alpha = round(preferences.getString("mot_a", "0.0").toFloat() * (float) FRAME_ARR_LEN);
-    int beta = round(preferences.getString("mot_b", "0.0").toFloat() * (float) COLOR_VAL_MAX);
-    if (is_motion_detected(frame, alpha, beta)) {
+  // the motion monitor already decided this frame is worth a query
+  if (!monitor_settings.enabled && preferences.isKey("motion") && preferences.getBool("motion") && preferences.isKey("mot_a") && preferences.isKey("mot_b")) {
+    motion_config motion_cfg;
+    load_motion_config(&motion_cfg);
+    motion_result motion_res = { false };
+    if (decode_motion_frame(frame)) {
+      motion_res = compare_motion_frame(motion_cfg);
+    } else {
+      debug_printf("Couldn't read a motion thumbnail from the %dx%d frame\n", frame->width, frame->height);
+    }
+    if (motion_res.lighting_change) {
+      motionState = LAST_FRAME_LIGHTING_CHANGE;
+      lighting_changes++;
+      debug_printf("Lighting changed (gain %.2f, offset %d), not motion\n", (float) motion_res.lighting_gain / MOTION_GAIN_ONE, motion_res.lighting_offset);
+    } else {
+      motionState = motion_res.motion ? LAST_FRAME_MOTION : LAST_FRAME_NO_MOTION;
+    }
+    if (motion_res.motion) {
       debug_println("Motion detected!");
+      motion_crop_valid = preferences.getBool("mot_crop", false)
+        && motion_region(motion_cfg, motion_res, frame->width, frame->height, preferences.getInt("mot_cpad", 64),
+                         preferences.getInt("mot_cmin", 320), &motion_crop_region);
     } else {
       esp_camera_fb_return(frame);
+      unlock_camera();
+      preferences.end();
+      unlock_preferences();
+      finish_preconnect(false);
       if (should_deep_sleep()) {
         vTaskDelay(500 / portTICK_PERIOD_MS);
         deep_sleep();
@@ -833,49 +1404,217 @@ void loop () {
     }
   }
   preferences.end();
+  unlock_preferences();
+
+  if (query_queue) {
+    // the network task takes it from here, so capturing can go on while it uploads
+    query_job job;
+    bool copied = copy_query_job(frame, &job);
+    esp_camera_fb_return(frame);
+    unlock_camera();
+    if (copied) {
+      queue_query_job(&job);
+    }
+    return;
+  }
 
+  start_wifi();
+  camera_fb_t crop;
+  bool cropped = crop_to_motion(frame, &crop);
+  finish_preconnect(true);
+  bool queried = run_image_query(cropped ? &crop : frame, frame);
+  if (cropped) {
+    free(crop.buf);
+  }
+  esp_camera_fb_return(frame);
+  unlock_camera();
+  if (!queried) {
+    return;
+  }
+
+  if (should_deep_sleep()) {
+    vTaskDelay(500 / portTICK_PERIOD_MS);
+    deep_sleep();
+  }
+
+  debug_printf("waiting %d seconds between queries...\n", query_delay);
+}
+
+// Starts connecting to Groundlight in the background for the image query this cycle may
+// send. Only runs when WiFi is already coming up: with motion detection on a sleeping camera
+// WiFi waits for motion, and waking the radio for a frame that turns out still would cost more
+// than the handshake saves. In pipeline mode the network task already overlaps uploads. Not
+// started when the frame is gated on motion, as most of those cycles end without a query and
+// the handshake would be thrown away along with the kept-alive connection.
+void start_preconnect() {
+  if (preconnect_task || query_queue || !wifi_started) {
+    return;
+  }
+  preconnect_cancelled = false;
+  xTaskCreatePinnedToCore(
+    preconnectTask,       // Function that should be called
+    "Pre-connect",        // Name of the task (for debugging)
+    8192,                 // Stack size (bytes)
+    NULL,                 // Parameter to pass
+    1,                    // Task priority
+    &preconnect_task,     // Task handle
+    0                     // Core, the protocol core WiFi runs on, leaving the application core to capture
+  );
+}
+
+// Waits for the pre-connect to finish. Without an upload the connection is closed; a wait for
+// WiFi is cut short, but a handshake under way has to complete first.
+void finish_preconnect(bool upload) {
+  if (!preconnect_task) {
+    return;
+  }
+  preconnect_cancelled = !upload;
+  unsigned long start = millis();
+  xSemaphoreTake(preconnect_done, portMAX_DELAY);
+  preconnect_task = NULL;
+  if (!upload) {
+    groundlight_client.stop();
+    debug_printf("No image query, closed the pre-connected connection\n");
+  } else {
+    debug_printf("Waited %lu ms for the pre-connect\n", millis() - start);
+  }
+}
+
+void preconnectTask(void * parameter) {
+  for (int i = 0; i < 100 && !WiFi.isConnected() && !preconnect_cancelled; i++) {
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+    // loop() waits for this task before it waits for WiFi itself, so the fallback is made here
+    if (wifi_from_cache && millis() - wifi_begin_time > WIFI_CACHE_CONNECT_MS) {
+      wifi_cache_failed();
+    }
+  }
+  if (WiFi.isConnected() && !preconnect_cancelled) {
+    unsigned long start = millis();
+    bool endpoint_cached = use_cached_endpoint_address();
+    restore_tls_session();
+    groundlight_client.begin(groundlight_endpoint, groundlight_API_key);
+    if (groundlight_client.connect()) {
+      debug_printf("Pre-connected to %s in %lu ms\n", groundlight_endpoint, millis() - start);
+    }
+    save_endpoint_address(endpoint_cached);
+  }
+  xSemaphoreGive(preconnect_done);
+  vTaskDelete(NULL);
+}
+
+// Publishes the last response from Groundlight and its query ID. With the pipeline these are
+// written on the network task while the listener task reads them for the state reply, which it
+// does holding the preferences lock, so they're only replaced under that lock. The task writing
+// them may read them without it.
+void set_query_results(const String &response, const String &id) {
+  lock_preferences();
+  queryResults = response;
+  queryID = id;
+  unlock_preferences();
+}
+
+// Uploads an image, waits for a confident answer and acts on it. Notifications attach
+// notify_fb. Returns false if there was no answer to act on.
+bool run_image_query(camera_fb_t *fb, camera_fb_t *notify_fb) {
   // wait for wifi connection
+  start_wifi();
   if (!WiFi.isConnected()) {
     debug_printf("having difficulty connection to WIFI SSID %s... status code : %d\n", ssid, WiFi.status());
     for (int i = 0; i < 100 && !WiFi.isConnected(); i++) {
       vTaskDelay(100 / portTICK_PERIOD_MS);
+      if (wifi_from_cache && millis() - wifi_begin_time > WIFI_CACHE_CONNECT_MS) {
+        wifi_cache_failed();
+      }
     }
   }
     if (WiFi.isConnected()) {
       debug_printf("WIFI connected to SSID %s\n", ssid);
-
+      if (!bootTiming.wifi_connected) {
+        bootTiming.wifi_connected = millis();
+      }
+      if (!wifi_cache_saved) {
+        save_wifi_cache();
+      }
   } else {
       debug_printf("unable to connect to wifi status code %d! (skipping image query and looping again)\n", WiFi.status());
-      return;
+      return false;
   }
 
   debug_printf("Submitting image query to Groundlight...");
 
-  queryResults = submit_image_query(frame, groundlight_endpoint, groundlight_det_id, groundlight_API_key);
-  queryID = get_query_id(queryResults);
+  bool endpoint_cached = use_cached_endpoint_address();
+  restore_tls_session();
+  groundlight_client.begin(groundlight_endpoint, groundlight_API_key);
+  int connections = groundlight_client.connections();
+  int requests = groundlight_client.requests();
+  unsigned long query_start = millis();
+  int wait_s = long_poll_wait(0);
+  String response = groundlight_client.submit_image_query(fb, groundlight_det_id, wait_s);
+  check_long_poll(wait_s, groundlight_client.last_response_ms(), response);
+  save_endpoint_address(endpoint_cached);
+  set_query_results(response, get_query_id(response));
+  tune_jpeg_quality();
+  if (!bootTiming.first_upload) {
+    bootTiming.first_upload = millis();
+    debug_printf("Boot timing (%s): setup started at %lu ms, camera ready at %lu ms, setup done at %lu ms, first capture at %lu ms, WiFi connected at %lu ms, first upload done at %lu ms\n",
+                 woke_from_sleep ? "woke from deep sleep" : "cold boot", bootTiming.setup_start, bootTiming.camera_ready,
+                 bootTiming.setup_done, bootTiming.first_capture, bootTiming.wifi_connected, bootTiming.first_upload);
+  }
 
   debug_printf("Query ID: %s\n", queryID.c_str());
+  if (monitor_settings.enabled) {
+    debug_printf("Motion to query latency: %lu ms\n", millis() - motion_trigger_time);
+  }
 
   if (queryID == "NONE" || queryID == "") {
     debug_println("Failed to get query ID");
-    esp_camera_fb_return(frame);
-    return;
+    return false;
   }
 
   debug_printf("Current confidence: %f / Target confidence %f\n", get_query_confidence(queryResults), targetConfidence);
 
-  // wait for confident answer
-  int currTime = millis();
-  while (get_query_confidence(queryResults) < targetConfidence) {
+  // wait for confident answer, held by the server where it can and polled for with a growing,
+  // jittered delay where it can't, until it is confident, final or the retry limit is reached
+  unsigned long deadline = millis() + retryLimit * 1000UL;
+  poll_schedule schedule;
+  poll_schedule_init(&schedule, pollSettings.initial_ms, pollSettings.multiplier, pollSettings.max_ms, pollSettings.jitter);
+  int polls = 0;
+  bool answered = true;
+  while (get_query_confidence(queryResults) < targetConfidence && !get_query_done(queryResults)) {
     debug_println("Waiting for confident answer...");
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-    queryResults = get_image_query(groundlight_endpoint, queryID.c_str(), groundlight_API_key);
-
-    if (millis() > currTime + retryLimit * 1000) {
-      debug_println("Retry limit reached!");
+    wait_s = long_poll_wait(millis() - query_start);
+    if (wait_s == 0) {
+      unsigned long delay_ms = poll_schedule_next(&schedule, esp_random());
+      unsigned long left = deadline > millis() ? deadline - millis() : 0;
+      vTaskDelay(min(delay_ms, left) / portTICK_PERIOD_MS);
+    }
+    response = groundlight_client.get_image_query(queryID.c_str(), wait_s);
+    check_long_poll(wait_s, groundlight_client.last_response_ms(), response);
+    set_query_results(response, queryID);
+    polls++;
+
+    if (millis() >= deadline) {
+      answered = get_query_confidence(queryResults) >= targetConfidence || get_query_done(queryResults);
+      if (!answered) {
+        debug_println("Retry limit reached!");
+      }
       break;
     }
   }
+  if (answered) {
+    last_answer_polls = polls;
+    answers_polled++;
+    answer_polls += polls;
+    debug_printf("Answer took %d polls\n", polls);
+  }
+  debug_printf("Image query took %d requests over %d new connections in %lu ms\n", groundlight_client.requests() - requests,
+               groundlight_client.connections() - connections, millis() - query_start);
+  if (groundlight_client.connections() > connections) {
+    tls_handshake_stats handshakes = get_tls_handshake_stats();
+    debug_printf("Last TLS handshake took %lu ms (%s)\n", handshakes.last_ms, handshakes.last_resumed ? "resumed" : "full");
+  }
+  // preferences are shared with loop() when the network task runs this
+  lock_preferences();
   ArduinoJson::DeserializationError error = deserializeJson(resultDoc, queryResults);
   if (error == ArduinoJson::DeserializationError::Ok) {
     if (resultDoc.containsKey("result")) {
@@ -912,7 +1651,7 @@ void loop () {
       }
     }
     if (shouldDoNotification(queryResults)) {
-      if (sendNotifications(last_label, frame)) {
+      if (sendNotifications(last_label, notify_fb)) {
         notificationState = NOTIFICATIONS_SENT;
       } else {
         notificationState = NOTIFICATION_ATTEMPT_FAILED;
@@ -938,15 +1677,8 @@ void loop () {
     debug_println("Failed to parse query results");
     debug_println(error.c_str());
   }
-
-  esp_camera_fb_return(frame);
-
-  if (should_deep_sleep()) {
-    vTaskDelay(500 / portTICK_PERIOD_MS);
-    deep_sleep();
-  }
-
-  debug_printf("waiting %d seconds between queries...\n", query_delay);
+  unlock_preferences();
+  return true;
 }
 
 StaticJsonDocument<4096> doc;
@@ -1044,8 +1776,243 @@ bool try_save_config(char * input) {
         preferences.remove("mot_a");
         preferences.remove("mot_b");
       }
+      JsonVariant motion_detection = doc["additional_config"]["motion_detection"];
+      if (motion_detection.containsKey("mode") && motion_detection["mode"] == "grid") {
+        debug_println("Has grid motion detection!");
+        preferences.putString("mot_mode", "grid");
+      } else {
+        preferences.remove("mot_mode");
+      }
+      if (motion_detection.containsKey("cell_alpha")) {
+        preferences.putString("mot_ca", (const char *) motion_detection["cell_alpha"]);
+      } else {
+        preferences.remove("mot_ca");
+      }
+      if (motion_detection.containsKey("min_cells")) {
+        preferences.putInt("mot_mc", motion_detection["min_cells"]);
+      } else {
+        preferences.remove("mot_mc");
+      }
+      if (motion_detection.containsKey("mask")) {
+        // either one string of cells or an array with one string per grid row
+        String mask = "";
+        if (motion_detection["mask"].is<JsonArray>()) {
+          for (JsonVariant row : motion_detection["mask"].as<JsonArray>()) {
+            mask += (const char *) row;
+          }
+        } else {
+          mask = (const char *) motion_detection["mask"];
+        }
+        bool cell_included[MOTION_GRID_CELLS];
+        if (motion_parse_cell_mask(mask.c_str(), cell_included) == MOTION_GRID_CELLS) {
+          preferences.putString("mot_mask", mask);
+        } else {
+          debug_printf("Ignoring motion mask, expected %d cells\n", MOTION_GRID_CELLS);
+          preferences.remove("mot_mask");
+        }
+      } else {
+        preferences.remove("mot_mask");
+      }
+      if (motion_detection.containsKey("learning_rate")) {
+        preferences.putString("mot_lr", (const char *) motion_detection["learning_rate"]);
+      } else {
+        preferences.remove("mot_lr");
+      }
+      if (motion_detection.containsKey("calibrate") && motion_detection["calibrate"]) {
+        // runs before the next capture and replaces alpha, beta and the cell alphas
+        debug_println("Motion calibration requested!");
+        preferences.putBool("mot_cal", true);
+      } else {
+        preferences.remove("mot_cal");
+        preferences.remove("mot_cca");
+        preferences.remove("mot_calt");
+      }
+      if (motion_detection.containsKey("ignore_lighting") && motion_detection["ignore_lighting"]) {
+        preferences.putBool("mot_light", true);
+      } else {
+        preferences.remove("mot_light");
+      }
+      if (motion_detection.containsKey("recalibrate_hours")) {
+        preferences.putInt("mot_rcal", motion_detection["recalibrate_hours"]);
+      } else {
+        preferences.remove("mot_rcal");
+      }
+      if (motion_detection.containsKey("monitor_fps")) {
+        debug_println("Has motion monitor!");
+        preferences.putFloat("mot_fps", motion_detection["monitor_fps"]);
+      } else {
+        preferences.remove("mot_fps");
+      }
+      if (motion_detection.containsKey("debounce_frames")) {
+        preferences.putInt("mot_deb", motion_detection["debounce_frames"]);
+      } else {
+        preferences.remove("mot_deb");
+      }
+      if (motion_detection.containsKey("min_interval")) {
+        preferences.putInt("mot_mint", motion_detection["min_interval"]);
+      } else {
+        preferences.remove("mot_mint");
+      }
+      if (motion_detection.containsKey("crop_to_motion") && motion_detection["crop_to_motion"]) {
+        preferences.putBool("mot_crop", true);
+      } else {
+        preferences.remove("mot_crop");
+      }
+      if (motion_detection.containsKey("crop_padding")) {
+        preferences.putInt("mot_cpad", motion_detection["crop_padding"]);
+      } else {
+        preferences.remove("mot_cpad");
+      }
+      if (motion_detection.containsKey("crop_min_size")) {
+        preferences.putInt("mot_cmin", motion_detection["crop_min_size"]);
+      } else {
+        preferences.remove("mot_cmin");
+      }
     } else {
       preferences.remove("motion");
+      preferences.remove("mot_mode");
+      preferences.remove("mot_ca");
+      preferences.remove("mot_mc");
+      preferences.remove("mot_mask");
+      preferences.remove("mot_lr");
+      preferences.remove("mot_cal");
+      preferences.remove("mot_cca");
+      preferences.remove("mot_calt");
+      preferences.remove("mot_rcal");
+      preferences.remove("mot_light");
+      preferences.remove("mot_fps");
+      preferences.remove("mot_deb");
+      preferences.remove("mot_mint");
+      preferences.remove("mot_crop");
+      preferences.remove("mot_cpad");
+      preferences.remove("mot_cmin");
+    }
+    if (doc["additional_config"].containsKey("pipeline")) {
+      // takes effect on the next restart
+      JsonVariant pipeline = doc["additional_config"]["pipeline"];
+      preferences.putInt("pl_depth", pipeline.containsKey("depth") ? pipeline["depth"].as<int>() : 2);
+      if (pipeline.containsKey("when_full") && pipeline["when_full"] == "block") {
+        preferences.putBool("pl_block", true);
+      } else {
+        preferences.remove("pl_block");
+      }
+    } else {
+      preferences.remove("pl_depth");
+      preferences.remove("pl_block");
+    }
+    if (doc["additional_config"].containsKey("image_profile")) {
+      // takes effect on the next restart, except for the quality tuning
+      JsonVariant profile = doc["additional_config"]["image_profile"];
+      if (profile.containsKey("name")) {
+        preferences.putString("img_prof", (const char *) profile["name"]);
+      } else {
+        preferences.remove("img_prof");
+      }
+      if (profile.containsKey("frame_size")) {
+        preferences.putString("img_fs", (const char *) profile["frame_size"]);
+      } else {
+        preferences.remove("img_fs");
+      }
+      if (profile.containsKey("quality")) {
+        preferences.putInt("img_q", profile["quality"]);
+      } else {
+        preferences.remove("img_q");
+      }
+      if (profile.containsKey("min_quality")) {
+        preferences.putInt("img_qmin", profile["min_quality"]);
+      } else {
+        preferences.remove("img_qmin");
+      }
+      if (profile.containsKey("max_quality")) {
+        preferences.putInt("img_qmax", profile["max_quality"]);
+      } else {
+        preferences.remove("img_qmax");
+      }
+      if (profile.containsKey("grayscale") && profile["grayscale"]) {
+        preferences.putBool("img_gray", true);
+      } else {
+        preferences.remove("img_gray");
+      }
+      if (profile.containsKey("target_kb")) {
+        preferences.putInt("img_tkb", profile["target_kb"]);
+      } else {
+        preferences.remove("img_tkb");
+      }
+      if (profile.containsKey("target_upload_ms")) {
+        preferences.putInt("img_tms", profile["target_upload_ms"]);
+      } else {
+        preferences.remove("img_tms");
+      }
+    } else {
+      preferences.remove("img_prof");
+      preferences.remove("img_fs");
+      preferences.remove("img_q");
+      preferences.remove("img_qmin");
+      preferences.remove("img_qmax");
+      preferences.remove("img_gray");
+      preferences.remove("img_tkb");
+      preferences.remove("img_tms");
+    }
+    // the motion thumbnail is read from SXGA frames, so a profile can't pick a smaller size
+    // while motion detection is on
+    image_profile saved_profile;
+    load_image_profile(&saved_profile);
+    if (preferences.getBool("motion", false) && saved_profile.frame_size != FRAMESIZE_SXGA) {
+      Serial.println("Motion detection needs SXGA frames, saving the image profile's frame size as SXGA");
+      preferences.putString("img_fs", "SXGA");
+    }
+    if (doc["additional_config"].containsKey("static_ip")) {
+      // takes effect on the next restart
+      JsonVariant static_ip_config = doc["additional_config"]["static_ip"];
+      preferences.putString("ip_addr", static_ip_config["ip"] | "");
+      preferences.putString("ip_gw", static_ip_config["gateway"] | "");
+      preferences.putString("ip_mask", static_ip_config["subnet"] | "255.255.255.0");
+      preferences.putString("ip_dns", static_ip_config["dns"] | (static_ip_config["gateway"] | ""));
+    } else {
+      preferences.remove("ip_addr");
+      preferences.remove("ip_gw");
+      preferences.remove("ip_mask");
+      preferences.remove("ip_dns");
+    }
+    if (doc["additional_config"].containsKey("burst")) {
+      JsonVariant burst = doc["additional_config"]["burst"];
+      preferences.putInt("burst_n", burst.containsKey("frames") ? burst["frames"].as<int>() : 3);
+      if (burst.containsKey("budget_ms")) {
+        preferences.putInt("burst_ms", burst["budget_ms"]);
+      } else {
+        preferences.remove("burst_ms");
+      }
+    } else {
+      preferences.remove("burst_n");
+      preferences.remove("burst_ms");
+    }
+    if (doc["additional_config"].containsKey("long_poll_s")) {
+      longPollWait = max(0, doc["additional_config"]["long_poll_s"].as<int>());
+      preferences.putInt("lp_wait", longPollWait);
+    } else {
+      longPollWait = 10;
+      preferences.remove("lp_wait");
+    }
+    if (doc["additional_config"].containsKey("polling")) {
+      JsonVariant polling = doc["additional_config"]["polling"];
+      pollSettings = make_poll_settings(polling["initial_ms"] | 1000, polling["multiplier"] | 1.25,
+                                        polling["max_ms"] | 3000, polling["jitter"] | 0.25);
+      preferences.putInt("poll_init", pollSettings.initial_ms);
+      preferences.putFloat("poll_mult", pollSettings.multiplier);
+      preferences.putInt("poll_max", pollSettings.max_ms);
+      preferences.putFloat("poll_jit", pollSettings.jitter);
+    } else {
+      pollSettings = { 1000, 1.25, 3000, 0.25 };
+      preferences.remove("poll_init");
+      preferences.remove("poll_mult");
+      preferences.remove("poll_max");
+      preferences.remove("poll_jit");
+    }
+    if (doc["additional_config"].containsKey("frame_buffers")) {
+      // takes effect when the camera is next initialized
+      preferences.putInt("fb_count", doc["additional_config"]["frame_buffers"]);
+    } else {
+      preferences.remove("fb_count");
     }
     if (doc["additional_config"].containsKey("img_rotate")) {
       debug_println("Image rotation found in configuration!");
@@ -1084,9 +2051,18 @@ bool try_save_config(char * input) {
 
   preferences.begin("config", true);
   decodeWorkingHoursString(preferences.getString("wkhrs", ""));
+  bool motion_needs_sxga = preferences.getBool("motion", false) && imageProfile.frame_size != FRAMESIZE_SXGA;
   preferences.end();
 
   doc.clear();
+  monitor_settings_changed = true;
+
+  if (motion_needs_sxga) {
+    // the camera's frame size is only set when it's initialized
+    Serial.println("Restarting in 3 seconds to switch the camera to SXGA for motion detection");
+    delay(3000);
+    ESP.restart();
+  }
 
   return true;
 }
@@ -1241,6 +2217,540 @@ bool decodeWorkingHoursString(String working_hours) {
   return true;
 }
 
+// Builds the motion detection settings from preferences. Expects preferences to be open.
+void load_motion_config(motion_config *config) {
+  int alpha = round(preferences.getString("mot_a", "0.0").toFloat() * (float) FRAME_ARR_LEN);
+  int beta = round(preferences.getString("mot_b", "0.0").toFloat() * (float) MOTION_LUMA_MAX);
+  motion_default_config(config, alpha, beta);
+  config->grid = preferences.getString("mot_mode", "") == "grid";
+  config->min_cells = preferences.getInt("mot_mc", 1);
+  if (preferences.isKey("mot_ca")) {
+    int cell_alpha = round(preferences.getString("mot_ca", "0.0").toFloat() * (float) MOTION_CELL_PIXELS);
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+      config->cell_alpha[i] = cell_alpha;
+    }
+  }
+  if (preferences.isKey("mot_mask")) {
+    motion_parse_cell_mask(preferences.getString("mot_mask", "").c_str(), config->cell_included);
+  }
+  // per cell alphas measured by calibration take precedence over cell_alpha
+  if (preferences.getBytesLength("mot_cca") == sizeof(config->cell_alpha)) {
+    preferences.getBytes("mot_cca", config->cell_alpha, sizeof(config->cell_alpha));
+  }
+  config->normalize_lighting = preferences.getBool("mot_light", false);
+  if (preferences.isKey("mot_lr")) {
+    float learning_rate = preferences.getString("mot_lr", "0.0").toFloat();
+    // any rate above zero learns at least one step
+    config->learning_rate = learning_rate > 0 ? max(1, (int) round(learning_rate * MOTION_RATE_ONE)) : 0;
+    config->learning_rate = min(config->learning_rate, MOTION_RATE_ONE);
+  }
+}
+
+#define MOTION_CALIBRATION_FRAMES 16
+// millis() at the last calibration attempt, for periodic recalibration while the clock isn't set
+unsigned long last_motion_calibration = 0;
+
+// Whether motion calibration was requested and hasn't succeeded yet, or periodic recalibration
+// is due. Expects preferences to be open.
+bool motion_calibration_due() {
+  if (preferences.getBool("mot_cal", false)) {
+    return true;
+  }
+  int hours = preferences.getInt("mot_rcal", 0);
+  if (hours <= 0) {
+    return false;
+  }
+  time_t now = time(NULL);
+  if (now > 1600000000 && preferences.isKey("mot_calt")) {
+    return now - (time_t) preferences.getULong("mot_calt", 0) >= hours * 3600;
+  }
+  return millis() - last_motion_calibration >= hours * 3600000UL;
+}
+
+// Measures sensor noise on a burst of frames of the (hopefully still) scene and stores the
+// motion thresholds derived from it. Expects preferences to be open.
+bool calibrate_motion() {
+  last_motion_calibration = millis();
+  time_t now = time(NULL);
+  if (now > 1600000000) {
+    preferences.putULong("mot_calt", now);
+  }
+
+  motion_calibration cal;
+  if (!motion_calibration_begin(&cal, MOTION_CALIBRATION_FRAMES)) {
+    return false;
+  }
+  for (int i = 0; i < MOTION_CALIBRATION_FRAMES; i++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb) {
+      if (decode_motion_frame(fb)) {
+        motion_calibration_add_frame(&cal);
+      }
+      esp_camera_fb_return(fb);
+    }
+  }
+  motion_config config;
+  load_motion_config(&config);
+  if (!motion_calibration_end(&cal, &config)) {
+    return false;
+  }
+
+  preferences.putString("mot_a", String((float) config.alpha / FRAME_ARR_LEN, 4));
+  preferences.putString("mot_b", String((float) config.beta / MOTION_LUMA_MAX, 3));
+  preferences.putBytes("mot_cca", config.cell_alpha, sizeof(config.cell_alpha));
+  preferences.remove("mot_cal");
+  debug_printf("Motion calibrated: alpha %s beta %s\n", preferences.getString("mot_a", "").c_str(), preferences.getString("mot_b", "").c_str());
+  return true;
+}
+
+// Reloads the motion monitor settings after a config change or calibration, and starts the
+// monitor the first time it's enabled. Runs in loop() so only one task uses preferences here.
+void load_motion_monitor_settings() {
+  monitor_settings_changed = false;
+  motion_monitor_settings settings = { false, 1000 };
+  lock_preferences();
+  preferences.begin("config", true);
+  float fps = preferences.isKey("mot_fps") ? preferences.getFloat("mot_fps", 0) : 0;
+  if (fps > 0 && preferences.getBool("motion", false) && preferences.isKey("mot_a") && preferences.isKey("mot_b")) {
+    settings.enabled = true;
+    settings.period_ms = 1000 / min(fps, (float) MOTION_MONITOR_MAX_FPS);
+    settings.debounce_frames = max(1, preferences.getInt("mot_deb", 2));
+    settings.min_interval_ms = max(0, preferences.getInt("mot_mint", 10)) * 1000;
+    settings.crop = preferences.getBool("mot_crop", false);
+    settings.crop_padding = preferences.getInt("mot_cpad", 64);
+    settings.crop_min_size = preferences.getInt("mot_cmin", 320);
+    load_motion_config(&settings.config);
+    // a change that stays has to be compared against the scene before it on every frame of the
+    // debounce, not against its own first frame
+    settings.config.hold_reference = settings.debounce_frames > 1;
+  }
+  preferences.end();
+  unlock_preferences();
+
+  lock_camera();
+  monitor_settings = settings;
+  unlock_camera();
+
+  if (settings.enabled && motion_monitor_task == NULL) {
+    debug_printf("Starting motion monitor at %d ms per frame\n", settings.period_ms);
+    xTaskCreatePinnedToCore(
+      motionMonitorTask,      // Function that should be called
+      "Motion Monitor",       // Name of the task (for debugging)
+      8192,                   // Stack size (bytes)
+      NULL,                   // Parameter to pass
+      1,                      // Task priority
+      &motion_monitor_task,   // Task handle
+      ARDUINO_RUNNING_CORE    // Core, the application core loop() runs on
+    );
+  }
+}
+
+// Checks for motion between image queries and wakes loop() once enough consecutive frames have
+// motion, so an event triggers a query right away instead of at the next query delay.
+void motionMonitorTask(void * parameter) {
+  int frames_with_motion = 0;
+  bool has_triggered = false;
+  unsigned long last_trigger = 0;
+  while (true) {
+    unsigned long start = millis();
+    int period_ms = 1000;
+    int debounce_frames = 1;
+    unsigned long min_interval_ms = 0;
+    bool checked = false;
+    bool triggered = false;
+    motion_result res = { false };
+    motion_monitor_settings *settings = &monitor_settings;
+    // loop() holds the camera while it captures and uploads, skip frames until it's done
+    if (xSemaphoreTake(camera_mutex, 0) == pdTRUE) {
+      period_ms = settings->period_ms;
+      debounce_frames = settings->debounce_frames;
+      min_interval_ms = settings->min_interval_ms;
+      if (settings->enabled) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb) {
+          checked = decode_motion_frame(fb);
+          if (checked) {
+            res = compare_motion_frame(settings->config);
+            frames_with_motion = res.motion ? frames_with_motion + 1 : 0;
+            triggered = frames_with_motion >= debounce_frames && (!has_triggered || millis() - last_trigger >= min_interval_ms);
+            if (triggered) {
+              motion_accept_frame(settings->config);
+            }
+          }
+          if (res.motion) {
+            motion_crop_valid = settings->crop
+              && motion_region(settings->config, res, fb->width, fb->height, settings->crop_padding,
+                               settings->crop_min_size, &motion_crop_region);
+          }
+          esp_camera_fb_return(fb);
+        }
+      }
+      xSemaphoreGive(camera_mutex);
+    } else {
+      frames_with_motion = 0;
+    }
+
+    if (checked) {
+      if (res.lighting_change) {
+        motionState = LAST_FRAME_LIGHTING_CHANGE;
+        lighting_changes++;
+      } else {
+        motionState = res.motion ? LAST_FRAME_MOTION : LAST_FRAME_NO_MOTION;
+      }
+      if (triggered) {
+        frames_with_motion = 0;
+        has_triggered = true;
+        last_trigger = millis();
+        motion_trigger_time = last_trigger;
+        xTaskNotifyGive(loop_task);
+      }
+    }
+
+    int wait_ms = period_ms - (int) (millis() - start);
+    vTaskDelay(max(1, wait_ms) / portTICK_PERIOD_MS);
+  }
+}
+
+// Copies a frame, or its crop to the motion, into PSRAM for the network task, so the camera
+// buffer can be returned before the frame is queued.
+bool copy_query_job(camera_fb_t *fb, query_job *job) {
+  camera_fb_t crop;
+  if (crop_to_motion(fb, &crop)) {
+    job->buf = crop.buf;
+    job->len = crop.len;
+    job->width = crop.width;
+    job->height = crop.height;
+  } else {
+    job->buf = (uint8_t *) ps_malloc(fb->len);
+    if (!job->buf) {
+      debug_println("Out of memory for the image query pipeline, skipping frame");
+      return false;
+    }
+    memcpy(job->buf, fb->buf, fb->len);
+    job->len = fb->len;
+    job->width = fb->width;
+    job->height = fb->height;
+  }
+  job->captured_at = millis();
+  return true;
+}
+
+// Hands a frame to the network task. When the queue is full the oldest waiting frame is
+// dropped, since a newer one says more about the scene, unless backpressure is on, in which
+// case capturing waits until the network task takes one.
+void queue_query_job(query_job *job) {
+  if (pipeline_backpressure) {
+    xQueueSend(query_queue, job, portMAX_DELAY);
+    return;
+  }
+  while (xQueueSend(query_queue, job, 0) != pdTRUE) {
+    query_job oldest;
+    if (xQueueReceive(query_queue, &oldest, 0) == pdTRUE) {
+      free(oldest.buf);
+      pipeline_dropped++;
+      debug_printf("Image query pipeline full, dropped the oldest frame (%d dropped so far)\n", pipeline_dropped);
+    }
+  }
+}
+
+// Uploads queued frames and waits for their answers on the other core, so a slow round trip
+// to Groundlight doesn't hold up capturing and motion detection.
+void networkTask(void * parameter) {
+  query_job job;
+  while (true) {
+    if (xQueueReceive(query_queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    debug_printf("Uploading frame captured %lu ms ago, %d more waiting\n", millis() - job.captured_at,
+                 uxQueueMessagesWaiting(query_queue));
+    camera_fb_t fb = {};
+    fb.buf = job.buf;
+    fb.len = job.len;
+    fb.width = job.width;
+    fb.height = job.height;
+    fb.format = PIXFORMAT_JPEG;
+    run_image_query(&fb, &fb);
+    free(job.buf);
+  }
+}
+
+framesize_t framesize_from_string(String name, framesize_t fallback) {
+  name.toUpperCase();
+  if (name == "QVGA") return FRAMESIZE_QVGA;
+  if (name == "VGA") return FRAMESIZE_VGA;
+  if (name == "SVGA") return FRAMESIZE_SVGA;
+  if (name == "XGA") return FRAMESIZE_XGA;
+  if (name == "HD") return FRAMESIZE_HD;
+  if (name == "SXGA") return FRAMESIZE_SXGA;
+  if (name == "UXGA") return FRAMESIZE_UXGA;
+  return fallback;
+}
+
+// Builds the image profile from a named preset and the settings that override it. Expects
+// preferences to be open.
+void load_image_profile(image_profile *profile) {
+  String name = preferences.getString("img_prof", "detail");
+  if (name == "small") {
+    *profile = { FRAMESIZE_VGA, 15, 15, 15, false, 0, 0 };
+  } else if (name == "balanced") {
+    *profile = { FRAMESIZE_SVGA, 12, 12, 12, false, 0, 0 };
+  } else {
+    *profile = { FRAMESIZE_SXGA, 10, 10, 10, false, 0, 0 };
+  }
+  profile->frame_size = framesize_from_string(preferences.getString("img_fs", ""), profile->frame_size);
+  profile->quality = constrain(preferences.getInt("img_q", profile->quality), 4, 63);
+  profile->grayscale = preferences.getBool("img_gray", false);
+  profile->target_bytes = preferences.getInt("img_tkb", 0) * 1024;
+  profile->target_ms = preferences.getInt("img_tms", 0);
+  // with a budget the quality may go down to max_quality to meet it
+  bool budget = profile->target_bytes > 0 || profile->target_ms > 0;
+  profile->min_quality = constrain(preferences.getInt("img_qmin", profile->quality), 4, profile->quality);
+  profile->max_quality = constrain(preferences.getInt("img_qmax", budget ? 40 : profile->quality), profile->quality, 63);
+}
+
+// Moves the JPEG quality towards the upload budget after an image query, using the measured
+// upload throughput for a time budget. JPEG size goes roughly with 1 / quality on these
+// sensors, so the quality is scaled by how far the upload was over or under the budget.
+void tune_jpeg_quality() {
+  upload_stats stats = get_last_upload_stats();
+  if (stats.bytes == 0) {
+    return;
+  }
+  if (stats.write_ms > 0) {
+    float rate = (float) stats.bytes / stats.write_ms;
+    upload_bytes_per_ms = upload_bytes_per_ms == 0 ? rate : 0.7 * upload_bytes_per_ms + 0.3 * rate;
+  }
+  debug_printf("Uploaded %d bytes at quality %d: connect %lu ms, write %lu ms in %d byte writes, response %lu ms\n",
+               stats.bytes, applied_jpeg_quality, stats.connect_ms, stats.write_ms, stats.write_size, stats.response_ms);
+
+  int budget = imageProfile.target_bytes;
+  if (imageProfile.target_ms > 0 && upload_bytes_per_ms > 0) {
+    int time_budget = upload_bytes_per_ms * imageProfile.target_ms;
+    budget = budget > 0 ? min(budget, time_budget) : time_budget;
+  }
+  if (budget <= 0) {
+    return;
+  }
+  float ratio = (float) stats.bytes / budget;
+  // a little under budget is on target, so the quality doesn't hunt
+  if (ratio >= 0.8 && ratio <= 1.0) {
+    return;
+  }
+  int quality = round(applied_jpeg_quality * ratio);
+  if (quality == applied_jpeg_quality) {
+    quality += ratio > 1.0 ? 1 : -1;
+  }
+  quality = constrain(quality, imageProfile.min_quality, imageProfile.max_quality);
+  if (quality != applied_jpeg_quality) {
+    debug_printf("Upload budget %d bytes, changing JPEG quality from %d to %d\n", budget, applied_jpeg_quality, quality);
+  }
+  jpeg_quality = quality;
+}
+
+// Applies the sensor settings from the config and image profile, after the camera driver is
+// initialized
+void apply_sensor_settings() {
+  sensor_t * s = esp_camera_sensor_get();
+  preferences.begin("config", true);
+  if (!preferences.getBool("img_rotate", false)) s->set_vflip(s, 1);
+  if (preferences.getBool("img_mirror", false)) s->set_hmirror(s, 1);
+  preferences.end();
+  if (imageProfile.grayscale) s->set_special_effect(s, 2);
+  s->set_quality(s, applied_jpeg_quality);
+}
+
+// Deinitializes and initializes the camera driver again, which powers the sensor down and up
+// and resets it, and checks that it captures. Gives up after CAMERA_RECOVERY_ATTEMPTS tries,
+// waiting a little longer before each one. Takes well under a second when the first try works,
+// against more than ten for a restart, a WiFi reconnect and a new TLS handshake.
+bool recover_camera() {
+  for (int attempt = 1; attempt <= CAMERA_RECOVERY_ATTEMPTS; attempt++) {
+    esp_camera_deinit();
+    vTaskDelay(100 * attempt / portTICK_PERIOD_MS);
+    esp_err_t error_code = esp_camera_init(&camera_config);
+    if (error_code == ESP_OK) {
+      apply_sensor_settings();
+      camera_fb_t *fb = esp_camera_fb_get();
+      if (fb) {
+        esp_camera_fb_return(fb);
+        camera_recoveries.reinits++;
+        camera_needs_warm_up = true;
+        debug_printf("Camera reinitialized on attempt %d\n", attempt);
+        return true;
+      }
+      debug_printf("Camera reinitialized on attempt %d but can't capture\n", attempt);
+    } else {
+      debug_printf("Camera reinitialization attempt %d failed with error code: %s\n", attempt, esp_err_to_name(error_code));
+    }
+    camera_recoveries.failed_reinits++;
+  }
+  return false;
+}
+
+// The last resort when the camera driver can't be brought back
+void restart_for_camera() {
+  camera_recoveries.restarts++;
+  debug_printf("Camera recovery failed! Restarting system in 3 seconds!\n");
+  delay(3000);
+  ESP.restart();
+}
+
+// Takes and throws away frames until auto exposure has settled, judged by the mean brightness
+// of each frame's thumbnail (see score_frame), or until WARM_UP_MAX_MS has passed. Settled means
+// WARM_UP_STABLE_FRAMES frames in a row within the tolerance of the frame that started the run,
+// so exposure still creeping towards its target doesn't pass a step at a time. The frames the
+// driver already buffered can be from before the flash turned on, so they're dropped unscored.
+// Frames that can't be scored don't count towards settling, so those wait out the whole bound.
+void warm_up_exposure() {
+  int64_t start = esp_timer_get_time();
+  int frames = 0;
+  for (int i = 0; i < camera_frame_buffers; i++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb) {
+      break;
+    }
+    esp_camera_fb_return(fb);
+    frames++;
+  }
+  int run_luma = -1;
+  int stable = 0;
+  while (stable < WARM_UP_STABLE_FRAMES && esp_timer_get_time() - start < WARM_UP_MAX_MS * 1000) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb) {
+      break;
+    }
+    frames++;
+    frame_score score;
+    bool scored = score_frame(fb, &score);
+    esp_camera_fb_return(fb);
+    if (!scored) {
+      continue;
+    }
+    if (run_luma >= 0 && abs(score.mean_luma - run_luma) <= WARM_UP_TOLERANCE) {
+      stable++;
+    } else {
+      run_luma = score.mean_luma;
+      stable = 0;
+    }
+  }
+  last_warm_up_ms = (esp_timer_get_time() - start) / 1000;
+  if (stable >= WARM_UP_STABLE_FRAMES) {
+    debug_printf("Exposure settled after %d frames in %d ms (mean luma %d)\n", frames, last_warm_up_ms, run_luma);
+  } else {
+    debug_printf("Exposure didn't settle in %d frames, gave up after %d ms\n", frames, last_warm_up_ms);
+  }
+}
+
+// Gets a frame that was captured after the last query. With grab latest the driver already
+// holds the newest complete frame. With a single buffer the buffered frame can be from long
+// ago, so it is returned and the next one is waited for, which costs up to two sensor frames.
+camera_fb_t *capture_fresh_frame() {
+  int64_t start = esp_timer_get_time();
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (fb && camera_frame_buffers == 1) {
+    esp_camera_fb_return(fb);
+    fb = esp_camera_fb_get();
+  }
+  if (fb) {
+    // the driver stamps frames with esp_timer at the start of the frame
+    int64_t now = esp_timer_get_time();
+    int64_t captured = (int64_t) fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    last_capture_ms = (now - start) / 1000;
+    last_frame_age_ms = (now - captured) / 1000;
+    debug_printf("Capture took %d ms with %d frame buffer(s), the frame is %d ms old\n", last_capture_ms,
+                 camera_frame_buffers, last_frame_age_ms);
+  }
+  return fb;
+}
+
+// Captures a burst of up to frames frames and keeps the one with the highest score_frame
+// score, returning the others as it goes. Scoring reads each JPEG once without decoding its
+// pixels, and no new frame is taken once budget_ms has passed, so a burst can't hold up the
+// image query for long. Frames that can't be scored, such as progressive ones, are never
+// picked over a scored one.
+camera_fb_t *capture_best_frame(int frames, int budget_ms) {
+  camera_fb_t *best = capture_fresh_frame();
+  last_burst_frames = best ? 1 : 0;
+  last_burst_score_us = 0;
+  if (!best || frames < 2) {
+    return best;
+  }
+  if (camera_frame_buffers < 2) {
+    debug_println("Burst capture needs at least 2 frame buffers, using a single frame");
+    return best;
+  }
+
+  int64_t start = esp_timer_get_time();
+  frame_score best_score;
+  bool best_scored = score_frame(best, &best_score);
+  last_burst_score_us = esp_timer_get_time() - start;
+  int best_index = 0;
+  while (last_burst_frames < frames && esp_timer_get_time() - start < (int64_t) budget_ms * 1000) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb) {
+      break;
+    }
+    last_burst_frames++;
+    int64_t score_start = esp_timer_get_time();
+    frame_score score;
+    bool scored = score_frame(fb, &score);
+    last_burst_score_us += esp_timer_get_time() - score_start;
+    if (scored && (!best_scored || score.score > best_score.score)) {
+      esp_camera_fb_return(best);
+      best = fb;
+      best_score = score;
+      best_scored = true;
+      best_index = last_burst_frames - 1;
+    } else {
+      esp_camera_fb_return(fb);
+    }
+  }
+
+  if (best_scored) {
+    debug_printf("Burst of %d frames in %d ms (%d us scoring per frame), frame %d is sharpest: score %.1f, %.1f bits/block, mean luma %d, %.1f%% clipped\n",
+                 last_burst_frames, (int) ((esp_timer_get_time() - start) / 1000), last_burst_score_us / last_burst_frames,
+                 best_index + 1, best_score.score, best_score.detail, best_score.mean_luma, 100 * best_score.clipped);
+  } else {
+    debug_printf("Burst of %d frames couldn't be scored, using the first\n", last_burst_frames);
+  }
+  return best;
+}
+
+// Crops a captured frame to the region with motion in the last frame that had motion, into a
+// newly allocated buffer in crop that the caller frees. Returns false, leaving the whole frame
+// to be uploaded, if cropping is off, there's no region or the frame couldn't be cropped.
+bool crop_to_motion(camera_fb_t *fb, camera_fb_t *crop) {
+  if (!motion_crop_valid) {
+    return false;
+  }
+  motion_crop_valid = false;
+  jpeg_crop_rect rect = { motion_crop_region.x, motion_crop_region.y, motion_crop_region.width, motion_crop_region.height };
+  if (rect.width >= (int) fb->width && rect.height >= (int) fb->height) {
+    return false;
+  }
+  // the crop can't be much bigger than the frame, and jpeg_crop fails rather than overflow
+  size_t crop_size = fb->len + 1024;
+  uint8_t *buf = (uint8_t *) ps_malloc(crop_size);
+  if (!buf) {
+    return false;
+  }
+  unsigned long start = millis();
+  size_t len = jpeg_crop(fb->buf, fb->len, &rect, buf, crop_size);
+  if (len == 0) {
+    debug_printf("Failed to crop the image to the motion, uploading the whole frame\n");
+    free(buf);
+    return false;
+  }
+  *crop = *fb;
+  crop->buf = buf;
+  crop->len = len;
+  crop->width = rect.width;
+  crop->height = rect.height;
+  debug_printf("Cropped image to motion at %d,%d %dx%d: %d of %d bytes in %lu ms\n", rect.x, rect.y, rect.width,
+               rect.height, len, fb->len, millis() - start);
+  return true;
+}
+
 void try_answer_query(String input) {
 
    // this is a blunt hammer but maybe necessary
@@ -1252,6 +2762,7 @@ void try_answer_query(String input) {
     Serial.println("Device Info:");
     Serial.println((StringSumHelper)"{\"name\":\"" + (String) NAME + "\",\"type\":\"Camera\",\"version\":\"" + VERSION + "\",\"mac_address\":\"" + WiFi.macAddress() + "\"}");
   } else if (input.indexOf("config") != -1) {
+    DynamicJsonDocument synthesisDoc(CONFIG_DOC_SIZE);
     preferences.begin("config");
     synthesisDoc["ssid"] = preferences.getString("ssid");
     synthesisDoc["password"] = preferences.getString("password");
@@ -1288,6 +2799,98 @@ void try_answer_query(String input) {
     if (preferences.isKey("motion") && preferences.getBool("motion", false) && preferences.isKey("mot_a") && preferences.isKey("mot_b")) {
       synthesisDoc["additional_config"]["motion_detection"]["alpha"] = preferences.getString("mot_a");
       synthesisDoc["additional_config"]["motion_detection"]["beta"] = preferences.getString("mot_b");
+      if (preferences.isKey("mot_mode")) {
+        synthesisDoc["additional_config"]["motion_detection"]["mode"] = preferences.getString("mot_mode");
+      }
+      if (preferences.isKey("mot_ca")) {
+        synthesisDoc["additional_config"]["motion_detection"]["cell_alpha"] = preferences.getString("mot_ca");
+      }
+      if (preferences.isKey("mot_mc")) {
+        synthesisDoc["additional_config"]["motion_detection"]["min_cells"] = preferences.getInt("mot_mc", 1);
+      }
+      if (preferences.isKey("mot_mask")) {
+        synthesisDoc["additional_config"]["motion_detection"]["mask"] = preferences.getString("mot_mask");
+      }
+      if (preferences.isKey("mot_lr")) {
+        synthesisDoc["additional_config"]["motion_detection"]["learning_rate"] = preferences.getString("mot_lr");
+      }
+      if (preferences.isKey("mot_cal") || preferences.isKey("mot_cca")) {
+        synthesisDoc["additional_config"]["motion_detection"]["calibrate"] = true;
+      }
+      if (preferences.isKey("mot_light")) {
+        synthesisDoc["additional_config"]["motion_detection"]["ignore_lighting"] = true;
+      }
+      if (preferences.isKey("mot_rcal")) {
+        synthesisDoc["additional_config"]["motion_detection"]["recalibrate_hours"] = preferences.getInt("mot_rcal", 0);
+      }
+      if (preferences.isKey("mot_fps")) {
+        synthesisDoc["additional_config"]["motion_detection"]["monitor_fps"] = preferences.getFloat("mot_fps", 0);
+      }
+      if (preferences.isKey("mot_deb")) {
+        synthesisDoc["additional_config"]["motion_detection"]["debounce_frames"] = preferences.getInt("mot_deb", 2);
+      }
+      if (preferences.isKey("mot_mint")) {
+        synthesisDoc["additional_config"]["motion_detection"]["min_interval"] = preferences.getInt("mot_mint", 10);
+      }
+      if (preferences.isKey("mot_crop")) {
+        synthesisDoc["additional_config"]["motion_detection"]["crop_to_motion"] = true;
+      }
+      if (preferences.isKey("mot_cpad")) {
+        synthesisDoc["additional_config"]["motion_detection"]["crop_padding"] = preferences.getInt("mot_cpad", 64);
+      }
+      if (preferences.isKey("mot_cmin")) {
+        synthesisDoc["additional_config"]["motion_detection"]["crop_min_size"] = preferences.getInt("mot_cmin", 320);
+      }
+    }
+    if (preferences.isKey("pl_depth")) {
+      synthesisDoc["additional_config"]["pipeline"]["depth"] = preferences.getInt("pl_depth", 2);
+      synthesisDoc["additional_config"]["pipeline"]["when_full"] = preferences.getBool("pl_block", false) ? "block" : "drop_oldest";
+    }
+    if (preferences.isKey("img_prof")) {
+      synthesisDoc["additional_config"]["image_profile"]["name"] = preferences.getString("img_prof");
+    }
+    if (preferences.isKey("img_fs")) {
+      synthesisDoc["additional_config"]["image_profile"]["frame_size"] = preferences.getString("img_fs");
+    }
+    if (preferences.isKey("img_q")) {
+      synthesisDoc["additional_config"]["image_profile"]["quality"] = preferences.getInt("img_q", 10);
+    }
+    if (preferences.isKey("img_qmin")) {
+      synthesisDoc["additional_config"]["image_profile"]["min_quality"] = preferences.getInt("img_qmin", 10);
+    }
+    if (preferences.isKey("img_qmax")) {
+      synthesisDoc["additional_config"]["image_profile"]["max_quality"] = preferences.getInt("img_qmax", 40);
+    }
+    if (preferences.isKey("img_gray")) {
+      synthesisDoc["additional_config"]["image_profile"]["grayscale"] = true;
+    }
+    if (preferences.isKey("img_tkb")) {
+      synthesisDoc["additional_config"]["image_profile"]["target_kb"] = preferences.getInt("img_tkb", 0);
+    }
+    if (preferences.isKey("img_tms")) {
+      synthesisDoc["additional_config"]["image_profile"]["target_upload_ms"] = preferences.getInt("img_tms", 0);
+    }
+    if (preferences.isKey("ip_addr")) {
+      synthesisDoc["additional_config"]["static_ip"]["ip"] = preferences.getString("ip_addr", "");
+      synthesisDoc["additional_config"]["static_ip"]["gateway"] = preferences.getString("ip_gw", "");
+      synthesisDoc["additional_config"]["static_ip"]["subnet"] = preferences.getString("ip_mask", "");
+      synthesisDoc["additional_config"]["static_ip"]["dns"] = preferences.getString("ip_dns", "");
+    }
+    if (preferences.isKey("burst_n")) {
+      synthesisDoc["additional_config"]["burst"]["frames"] = preferences.getInt("burst_n", 3);
+      synthesisDoc["additional_config"]["burst"]["budget_ms"] = preferences.getInt("burst_ms", 500);
+    }
+    if (preferences.isKey("poll_init")) {
+      synthesisDoc["additional_config"]["polling"]["initial_ms"] = preferences.getInt("poll_init", 1000);
+      synthesisDoc["additional_config"]["polling"]["multiplier"] = preferences.getFloat("poll_mult", 1.25);
+      synthesisDoc["additional_config"]["polling"]["max_ms"] = preferences.getInt("poll_max", 3000);
+      synthesisDoc["additional_config"]["polling"]["jitter"] = preferences.getFloat("poll_jit", 0.25);
+    }
+    if (preferences.isKey("lp_wait")) {
+      synthesisDoc["additional_config"]["long_poll_s"] = preferences.getInt("lp_wait", 10);
+    }
+    if (preferences.isKey("fb_count")) {
+      synthesisDoc["additional_config"]["frame_buffers"] = preferences.getInt("fb_count", 2);
     }
     if (preferences.isKey("img_rotate")) {
       synthesisDoc["additional_config"]["img_rotate"] = preferences.getBool("img_rotate", false);
@@ -1295,12 +2898,15 @@ void try_answer_query(String input) {
     if (preferences.isKey("img_mirror")) {
       synthesisDoc["additional_config"]["img_mirror"] = preferences.getBool("img_mirror", false);
     }
+    if (synthesisDoc.overflowed()) {
+      Serial.println("WARNING! The device config didn't fit the reply, some settings are missing");
+    }
     Serial.println("Device Config:");
     serializeJson(synthesisDoc, Serial);
     Serial.println();
     preferences.end();
-    synthesisDoc.clear();
   } else if (input.indexOf("state") != -1) {
+    DynamicJsonDocument synthesisDoc(STATE_DOC_SIZE + queryResults.length());
     preferences.begin("config");
     synthesisDoc["wifi_state"] = WiFi.isConnected() ? "Connected" : "Disconnected";
     synthesisDoc["query_state"] = queryStateToString((QueryState) preferences.getInt("qSt", queryState));
@@ -1310,40 +2916,57 @@ void try_answer_query(String input) {
     if (preferences.isKey("sl_uuid")) {
       synthesisDoc["stacklight_state"] = stacklightStateToString(stacklightState);
     }
+    if (preferences.getBool("motion", false)) {
+      synthesisDoc["motion_state"] = motionStateToString(motionState);
+      if (preferences.getBool("mot_light", false)) {
+        synthesisDoc["lighting_changes"] = lighting_changes;
+      }
+    }
+    if (query_queue) {
+      synthesisDoc["pipeline_waiting"] = uxQueueMessagesWaiting(query_queue);
+      synthesisDoc["pipeline_dropped"] = pipeline_dropped;
+    }
+    synthesisDoc["long_poll_state"] = longPollStateToString(longPollState);
+    if (answers_polled > 0) {
+      synthesisDoc["last_answer_polls"] = last_answer_polls;
+      synthesisDoc["polls_per_answer"] = (float) answer_polls / answers_polled;
+    }
+    synthesisDoc["jpeg_quality"] = applied_jpeg_quality;
+    if (upload_bytes_per_ms > 0) {
+      synthesisDoc["upload_kb_per_s"] = upload_bytes_per_ms * 1000 / 1024;
+      synthesisDoc["upload_write_size"] = get_last_upload_stats().write_size;
+    }
+    synthesisDoc["boot_ms"]["camera_ready"] = bootTiming.camera_ready;
+    synthesisDoc["boot_ms"]["setup_done"] = bootTiming.setup_done;
+    synthesisDoc["boot_ms"]["first_capture"] = bootTiming.first_capture;
+    synthesisDoc["boot_ms"]["wifi_connected"] = bootTiming.wifi_connected;
+    synthesisDoc["boot_ms"]["first_upload"] = bootTiming.first_upload;
+    tls_handshake_stats handshakes = get_tls_handshake_stats();
+    synthesisDoc["tls_handshakes"]["full"] = handshakes.full;
+    synthesisDoc["tls_handshakes"]["resumed"] = handshakes.resumed;
+    if (handshakes.full > 0) {
+      synthesisDoc["tls_handshakes"]["full_ms"] = handshakes.full_ms / handshakes.full;
+    }
+    if (handshakes.resumed > 0) {
+      synthesisDoc["tls_handshakes"]["resumed_ms"] = handshakes.resumed_ms / handshakes.resumed;
+    }
+    synthesisDoc["warm_up_ms"] = last_warm_up_ms;
+    synthesisDoc["camera_recoveries"]["reinit"] = camera_recoveries.reinits;
+    synthesisDoc["camera_recoveries"]["reinit_failed"] = camera_recoveries.failed_reinits;
+    synthesisDoc["camera_recoveries"]["restart"] = camera_recoveries.restarts;
+    synthesisDoc["capture_ms"] = last_capture_ms;
+    synthesisDoc["frame_age_ms"] = last_frame_age_ms;
+    if (last_burst_frames > 1) {
+      synthesisDoc["burst_frames"] = last_burst_frames;
+      synthesisDoc["burst_score_us"] = last_burst_score_us;
+    }
     synthesisDoc["query"] = queryResults;
     preferences.end();
+    if (synthesisDoc.overflowed()) {
+      Serial.println("WARNING! The device state didn't fit the reply, some fields are missing");
+    }
     Serial.println("Device State:");
     serializeJson(synthesisDoc, Serial);
     Serial.println();
-    synthesisDoc.clear();
   }
 }
-
-bool is_motion_detected(camera_fb_t* frame, int alpha, int beta) {
-  bool worked = jpg2rgb565(frame->buf, frame->len, frame_565, JPG_SCALE_8X);
-  if (!worked) {
-    return false;
-  }
-  // try to detect motion
-  int num_diffs = 0;
-  for (int i = 0; i < FRAME_ARR_LEN; i += 2) {
-    uint16_t color = (frame_565[i] << 8) | frame_565[i + 1];
-    uint16_t color_old = (frame_565_old[i] << 8) | frame_565_old[i + 1];
-    uint8_t b_diff = abs((color & 0b11111) - (color_old & 0b11111));
-    uint8_t g_diff = abs(((color >> 5) & 0b111111) - ((color_old >> 5) & 0b111111));
-    uint8_t r_diff = abs(((color >> 11) & 0b11111) - ((color_old >> 11) & 0b11111));
-    if (b_diff > beta || (g_diff >> 1) > beta || r_diff > beta) {
-      num_diffs++;
-    }
-  }
-  bool motion_detected = num_diffs > alpha;
-
-  if (motion_detected) {
-    for (int i = 0; i < FRAME_ARR_LEN; i += 2) {
-      frame_565_old[i] = frame_565[i];
-      frame_565_old[i + 1] = frame_565[i + 1];
-    }
-  }
-
-  return motion_detected;
-}
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <ArduinoJson.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
+#include "tls_session.h"
 #include "esp_camera.h"
 #include "twilio.hpp"
 
@@ -61,8 +62,9 @@ SlackNotificationResult sendSlackNotification(String detectorName, String query,
     serializeJson(slackData, Serial);
     // Serial.printf("\n(done!)\n");
 
-    // Initialize WiFiClientSecure and HTTPClient.
-    WiFiClientSecure *client = new WiFiClientSecure;
+    // Initialize WiFiClientSecure and HTTPClient. Notifications resume the TLS session of the
+    // last one when the webhook server still has it.
+    WiFiClientSecure *client = new ResumableClientSecure;
     HTTPClient https;
 
     if (client) {
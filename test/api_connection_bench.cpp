@@ -0,0 +1,141 @@
+/*
+
+Groundlight benchmark of the connections made for an image query and its polls. Provided under MIT License below:
+
+Copyright (c) 2023 Groundlight, Inc.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+// Runs the same image queries against bench/mock_groundlight.py twice, once with the one-shot
+// functions that connect for every request and once with a GroundlightClient that keeps its
+// connection open, and prints the connections and time each took. Start the mock on a
+// computer on the same network first, such as with
+//
+//   python3 bench/mock_groundlight.py --polls 10
+//
+// and set mock_endpoint to its address and port. It then times TLS handshakes to the mock with
+// and without resuming the session of the connection before.
+
+#include <Arduino.h>
+#include "WiFi.h"
+#include "groundlight.h"
+
+char mock_endpoint[40] = "192.168.1.10:8443";
+char groundlight_API_key[75] = "api_mock";
+char detector_id[40] = "det_mock";
+char ssid[40] = "yourssidhere";
+char password[40] = "yourwifipasswordhere";
+
+const int queries = 5;
+const int handshakes = 10;
+const size_t image_size = 60 * 1024;    // about an SXGA frame at quality 10
+
+camera_fb_t image;
+
+// Submits image queries and polls each until it is confident, like the firmware does. client
+// is the one submit and poll go through, or NULL if they connect for every request.
+template <typename Submit, typename Poll>
+void run_queries(const char *name, Submit submit, Poll poll, GroundlightClient *client)
+{
+  unsigned long start = millis();
+  int requests = 0;
+  for (int i = 0; i < queries; i++) {
+    String results = submit();
+    requests++;
+    String query_id = get_query_id(results);
+    if (query_id == "NONE") {
+      Serial.printf("%s: image query failed: %s\n", name, results.c_str());
+      return;
+    }
+    while (get_query_confidence(results) < 0.9) {
+      results = poll(query_id.c_str());
+      requests++;
+    }
+  }
+  unsigned long took = millis() - start;
+  Serial.printf("%s: %d image queries, %d requests over %d connections in %lu ms, %lu ms per request\n",
+                name, queries, requests, client ? client->connections() : requests, took, took / requests);
+}
+
+// Connects to the mock repeatedly, each time after closing the connection before, and prints
+// the mean time to connect
+template <typename Client>
+void run_handshakes(const char *name)
+{
+  String host = get_endpoint_host(mock_endpoint);
+  int port = String(mock_endpoint).substring(host.length() + 1).toInt();
+  unsigned long took = 0;
+  for (int i = 0; i < handshakes; i++) {
+    Client client;
+    client.setInsecure();
+    unsigned long start = millis();
+    if (!client.connect(host.c_str(), port)) {
+      Serial.printf("%s: couldn't connect to %s\n", name, mock_endpoint);
+      return;
+    }
+    took += millis() - start;
+    client.stop();
+  }
+  Serial.printf("%s: %d connections, %lu ms per connection\n", name, handshakes, took / handshakes);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  Serial.println("Waking up...");
+
+  WiFi.begin(ssid, password);
+  while (!WiFi.isConnected()) {
+    delay(100);
+  }
+
+  // the mock only checks for the JPEG start of image marker
+  image.buf = (uint8_t *) ps_malloc(image_size);
+  memset(image.buf, 0, image_size);
+  image.buf[0] = 0xFF;
+  image.buf[1] = 0xD8;
+  image.buf[image_size - 2] = 0xFF;
+  image.buf[image_size - 1] = 0xD9;
+  image.len = image_size;
+  image.format = PIXFORMAT_JPEG;
+
+  run_queries("One connection per request",
+              []() { return submit_image_query(&image, mock_endpoint, detector_id, groundlight_API_key); },
+              [](const char *query_id) { return get_image_query(mock_endpoint, query_id, groundlight_API_key); },
+              NULL);
+
+  GroundlightClient client;
+  client.begin(mock_endpoint, groundlight_API_key);
+  run_queries("Kept-alive connection",
+              [&]() { return client.submit_image_query(&image, detector_id); },
+              [&](const char *query_id) { return client.get_image_query(query_id); },
+              &client);
+
+  run_handshakes<WiFiClientSecure>("Full TLS handshakes");
+  run_handshakes<ResumableClientSecure>("Resumed TLS handshakes");
+  tls_handshake_stats stats = get_tls_handshake_stats();
+  Serial.printf("ResumableClientSecure made %d full handshakes and %d resumed ones\n", stats.full, stats.resumed);
+}
+
+void loop()
+{
+  // do nothing
+}
@@ -31,6 +31,7 @@ SOFTWARE.
 #include <time.h>
 #include "ArduinoJson.h"
 #include "groundlight.h"
+#include "motion.h"
 
 #include "camera_pins.h" // thank you seeedstudio for this file
 #include "integrations.h"
@@ -157,17 +158,9 @@ int last_print_time = 0;
 char input2[1000];
 int input2_index = 0;
 bool new_data = false;
-// #define FRAME_ARR_LEN ((1600 / 8) * (1200 / 8) * 2)
-// #define FRAME_ARR_LEN 1600 * 1200 * 2 / 64
-// #define FRAME_ARR_LEN 1280 * 1024 * 3 / 64
-#define FRAME_ARR_LEN 1280 * 1024 * 2 / 64
-// uint8_t frame_565[FRAME_ARR_LEN];
-uint8_t *frame_565;
-uint8_t *frame_565_old;
-// uint8_t frame_565_old[FRAME_ARR_LEN];
 #define ALPHA_DIVISOR 10
-#define ALPHA FRAME_ARR_LEN / ALPHA_DIVISOR
-#define BETA 20 // out of 31
+#define ALPHA (MOTION_LUMA_LEN / ALPHA_DIVISOR)
+#define BETA 80 // out of 127
 
 void setup() {
   Serial.begin(115200);
@@ -209,57 +202,34 @@ void setup() {
   }
 
   // alloc memory for 565 frames
-  frame_565 = (uint8_t *) ps_malloc(FRAME_ARR_LEN);
-  frame_565_old = (uint8_t *) ps_malloc(FRAME_ARR_LEN);
+  motion_begin();
 
   vTaskDelay(100 / portTICK_PERIOD_MS);
   Serial.println("Camera Initialized");
   vTaskDelay(100 / portTICK_PERIOD_MS);
 }
 
-int num_diffs = 0;
-
-bool is_motion_detected(camera_fb_t* frame) {
-  bool worked = jpg2rgb565(frame->buf, frame->len, frame_565, JPG_SCALE_8X);
-  if (!worked) {
-    return false;
-  }
-  // try to detect motion
-  num_diffs = 0;
-  for (int i = 0; i < FRAME_ARR_LEN; i += 2) {
-    uint16_t color = (frame_565[i] << 8) | frame_565[i + 1];
-    uint16_t color_old = (frame_565_old[i] << 8) | frame_565_old[i + 1];
-    uint8_t b_diff = abs((color & 0b11111) - (color_old & 0b11111));
-    uint8_t g_diff = abs(((color >> 5) & 0b111111) - ((color_old >> 5) & 0b111111));
-    uint8_t r_diff = abs(((color >> 11) & 0b11111) - ((color_old >> 11) & 0b11111));
-    if (b_diff > BETA || (g_diff >> 1) > BETA || r_diff > BETA) {
-      num_diffs++;
-    }
-  }
-  bool motion_detected = num_diffs > ALPHA;
-
-  if (motion_detected) {
-    for (int i = 0; i < FRAME_ARR_LEN; i += 2) {
-      frame_565_old[i] = frame_565[i];
-      frame_565_old[i + 1] = frame_565[i + 1];
-    }
-  }
-}
-
 void loop () {
   frame = esp_camera_fb_get();
   // Testing how to get the latest image
   esp_camera_fb_return(frame);
   frame = esp_camera_fb_get();
 
+  // time the full decoder against the DC-only decoder the detector uses
   int time = millis();
-  bool motion_detected = is_motion_detected(frame);
+  decode_motion_frame_full(frame);
   int time2 = millis();
-  Serial.println((StringSumHelper) "Time to detect motion: " + (time2 - time) + "ms");
-  if (motion_detected) {
-    debug((StringSumHelper) "Motion detected! " + num_diffs + " diffs");
+  motion_result res = { false, 0 };
+  if (decode_motion_frame(frame)) {
+    res = compare_motion_frame(ALPHA, BETA);
+  }
+  int time3 = millis();
+  Serial.println((StringSumHelper) "Time to decode with the full decoder: " + (time2 - time) + "ms");
+  Serial.println((StringSumHelper) "Time to detect motion: " + (time3 - time2) + "ms" + (motion_frame_from_dc() ? "" : " (no DC path)"));
+  if (res.motion) {
+    debug((StringSumHelper) "Motion detected! " + res.num_diffs + " diffs");
   } else {
-    // debug((StringSumHelper) "No motion detected! " + num_diffs + " diffs");
+    // debug((StringSumHelper) "No motion detected! " + res.num_diffs + " diffs");
   }
 
   if (!frame)
@@ -0,0 +1,182 @@
+// Host unit tests for the HTTP response parser in lib/http, run with
+//
+//   pio test -e native_http
+
+#include <string.h>
+#include <unity.h>
+
+#include "http_response.h"
+
+static char body[1024];
+static http_response response;
+
+void setUp()
+{
+  memset(body, 'x', sizeof(body));
+}
+
+void tearDown()
+{
+}
+
+// Parses a whole response fed in pieces of at most step bytes
+static http_response_result parse(const char *text, size_t step, size_t body_size = sizeof(body))
+{
+  http_response_init(&response, body, body_size);
+  size_t len = strlen(text);
+  http_response_result result = HTTP_RESPONSE_MORE;
+  for (size_t pos = 0; pos < len && result == HTTP_RESPONSE_MORE;) {
+    size_t n = len - pos < step ? len - pos : step;
+    size_t used;
+    result = http_response_feed(&response, (const uint8_t *) text + pos, n, &used);
+    pos += used;
+  }
+  return result;
+}
+
+static const char *content_length_response =
+  "HTTP/1.1 201 Created\r\n"
+  "Content-Type: application/json\r\n"
+  "content-length: 26\r\n"
+  "\r\n"
+  "{\"id\": \"iq_1\", \"ok\": true}";
+
+static const char *chunked_response =
+  "HTTP/1.1 200 OK\r\n"
+  "Transfer-Encoding: chunked\r\n"
+  "\r\n"
+  "5;name=value\r\n"
+  "{\"id\"\r\n"
+  "F\r\n"
+  ": \"iq_1\", \"ok\":\r\n"
+  "6\r\n"
+  " true}\r\n"
+  "0\r\n"
+  "X-Trailer: yes\r\n"
+  "\r\n";
+
+void test_content_length()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(content_length_response, 4096));
+  TEST_ASSERT_EQUAL(201, response.status);
+  TEST_ASSERT_EQUAL(26, response.content_length);
+  TEST_ASSERT_TRUE(response.keep_alive);
+  TEST_ASSERT_FALSE(response.truncated);
+  TEST_ASSERT_EQUAL_STRING("{\"id\": \"iq_1\", \"ok\": true}", body);
+  TEST_ASSERT_EQUAL(26, response.body_len);
+}
+
+void test_chunked()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(chunked_response, 4096));
+  TEST_ASSERT_EQUAL(200, response.status);
+  TEST_ASSERT_TRUE(response.chunked);
+  TEST_ASSERT_TRUE(response.keep_alive);
+  TEST_ASSERT_EQUAL_STRING("{\"id\": \"iq_1\", \"ok\": true}", body);
+}
+
+// The same result however the response is split across reads
+void test_any_split()
+{
+  for (size_t step = 1; step < strlen(chunked_response); step++) {
+    TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(chunked_response, step));
+    TEST_ASSERT_EQUAL_STRING("{\"id\": \"iq_1\", \"ok\": true}", body);
+    TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(content_length_response, step));
+    TEST_ASSERT_EQUAL_STRING("{\"id\": \"iq_1\", \"ok\": true}", body);
+  }
+}
+
+void test_connection_header()
+{
+  parse("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", 4096);
+  TEST_ASSERT_FALSE(response.keep_alive);
+  parse("HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n", 4096);
+  TEST_ASSERT_FALSE(response.keep_alive);
+  parse("HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 0\r\n\r\n", 4096);
+  TEST_ASSERT_TRUE(response.keep_alive);
+}
+
+void test_body_until_close()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_MORE, parse("HTTP/1.1 200 OK\r\n\r\n{\"a\": 1}", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, http_response_end(&response));
+  TEST_ASSERT_FALSE(response.keep_alive);
+  TEST_ASSERT_EQUAL_STRING("{\"a\": 1}", body);
+}
+
+void test_cut_short()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_MORE, parse("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n12345", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, http_response_end(&response));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_MORE, parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\n12345\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, http_response_end(&response));
+}
+
+void test_truncated()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(content_length_response, 4096, 8));
+  TEST_ASSERT_TRUE(response.truncated);
+  TEST_ASSERT_EQUAL_STRING("{\"id\": ", body);
+}
+
+void test_no_body()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse("HTTP/1.1 204 No Content\r\n\r\n", 4096));
+  TEST_ASSERT_EQUAL(204, response.status);
+  TEST_ASSERT_TRUE(response.keep_alive);
+  TEST_ASSERT_EQUAL_STRING("", body);
+}
+
+void test_interim_response()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 401 Unauthorized\r\nContent-Length: 2\r\n\r\n{}", 4096));
+  TEST_ASSERT_EQUAL(401, response.status);
+  TEST_ASSERT_EQUAL_STRING("{}", body);
+}
+
+// Bytes after the response are left for the next one
+void test_stops_at_end()
+{
+  const char *two = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}HTTP/1.1 200 OK\r\n";
+  http_response_init(&response, body, sizeof(body));
+  size_t used;
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, http_response_feed(&response, (const uint8_t *) two, strlen(two), &used));
+  TEST_ASSERT_EQUAL(strlen(two) - strlen("HTTP/1.1 200 OK\r\n"), used);
+}
+
+void test_long_header()
+{
+  char text[1024] = "HTTP/1.1 200 OK\r\nX-Long: ";
+  memset(text + strlen(text), 'a', 600);
+  strcat(text, "\r\nContent-Length: 2\r\n\r\n{}");
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_DONE, parse(text, 4096));
+  TEST_ASSERT_EQUAL_STRING("{}", body);
+}
+
+void test_malformed()
+{
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("<html>\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("HTTP/1.1 2x0 OK\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("HTTP/1.1 200 OK\r\nContent-Length: lots\r\n\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("HTTP/1.1 200 OK\r\nno colon\r\n\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 4096));
+  TEST_ASSERT_EQUAL(HTTP_RESPONSE_ERROR, parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\n{}xx\r\n", 4096));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_content_length);
+  RUN_TEST(test_chunked);
+  RUN_TEST(test_any_split);
+  RUN_TEST(test_connection_header);
+  RUN_TEST(test_body_until_close);
+  RUN_TEST(test_cut_short);
+  RUN_TEST(test_truncated);
+  RUN_TEST(test_no_body);
+  RUN_TEST(test_interim_response);
+  RUN_TEST(test_stops_at_end);
+  RUN_TEST(test_long_header);
+  RUN_TEST(test_malformed);
+  return UNITY_END();
+}
@@ -0,0 +1,84 @@
+// Host unit tests for the polling backoff schedule in lib/http, run with
+//
+//   pio test -e native_http
+
+#include <unity.h>
+
+#include "poll_schedule.h"
+
+static poll_schedule schedule;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_grows_to_the_cap()
+{
+  poll_schedule_init(&schedule, 500, 2, 3000, 0);
+  TEST_ASSERT_EQUAL(500, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(1000, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(2000, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(3000, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(3000, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(5, schedule.polls);
+}
+
+void test_fixed_interval()
+{
+  // the old behavior, a poll every second
+  poll_schedule_init(&schedule, 1000, 1, 1000, 0);
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL(1000, poll_schedule_next(&schedule, 0xFFFFFFFF));
+  }
+}
+
+void test_jitter_stays_in_range()
+{
+  poll_schedule_init(&schedule, 1000, 1, 1000, 0.5);
+  TEST_ASSERT_EQUAL(1000, poll_schedule_next(&schedule, 0));
+  TEST_ASSERT_EQUAL(750, poll_schedule_next(&schedule, 0x80000000));
+  unsigned long lowest = poll_schedule_next(&schedule, 0xFFFFFFFF);
+  TEST_ASSERT_TRUE(lowest >= 500 && lowest <= 501);
+}
+
+void test_jitter_spreads_devices()
+{
+  // two devices polling the same way with different random numbers don't poll together
+  poll_schedule a, b;
+  poll_schedule_init(&a, 1000, 1.5, 8000, 0.5);
+  poll_schedule_init(&b, 1000, 1.5, 8000, 0.5);
+  unsigned long time_a = 0, time_b = 0;
+  uint32_t seed_a = 1, seed_b = 2;
+  for (int i = 0; i < 6; i++) {
+    seed_a = seed_a * 1664525 + 1013904223;
+    seed_b = seed_b * 1664525 + 1013904223;
+    time_a += poll_schedule_next(&a, seed_a);
+    time_b += poll_schedule_next(&b, seed_b);
+  }
+  TEST_ASSERT_TRUE(time_a != time_b);
+}
+
+void test_settings_brought_into_range()
+{
+  poll_schedule_init(&schedule, 1000, 0.5, 200, 3);
+  TEST_ASSERT_TRUE(schedule.multiplier == 1);
+  TEST_ASSERT_EQUAL(1000, schedule.max_ms);
+  TEST_ASSERT_TRUE(schedule.jitter == 1);
+  poll_schedule_init(&schedule, 1000, 2, 4000, -1);
+  TEST_ASSERT_TRUE(schedule.jitter == 0);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_grows_to_the_cap);
+  RUN_TEST(test_fixed_interval);
+  RUN_TEST(test_jitter_stays_in_range);
+  RUN_TEST(test_jitter_spreads_devices);
+  RUN_TEST(test_settings_brought_into_range);
+  return UNITY_END();
+}
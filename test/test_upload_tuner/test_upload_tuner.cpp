@@ -0,0 +1,105 @@
+// Host unit tests for the upload write size tuner in lib/http, run with
+//
+//   pio test -e native_http
+
+#include <unity.h>
+
+#include "upload_tuner.h"
+
+static upload_tuner tuner;
+
+void setUp()
+{
+  upload_tuner_init(&tuner);
+}
+
+void tearDown()
+{
+}
+
+// Uploads 40 KB at the rate the network gives the current size, in KB per ms for each size
+static void upload(const float *kb_per_ms)
+{
+  size_t bytes = 40 * 1024;
+  float rate = kb_per_ms[tuner.current] * 1024;
+  upload_tuner_record(&tuner, bytes, (unsigned long) (bytes / rate));
+}
+
+void test_starts_at_a_full_record()
+{
+  TEST_ASSERT_EQUAL(4096, upload_tuner_segment_size(&tuner));
+}
+
+void test_tries_neighbors_first()
+{
+  const float flat[UPLOAD_SEGMENT_SIZES] = { 1, 1, 1, 1, 1 };
+  upload(flat);
+  TEST_ASSERT_EQUAL(8192, upload_tuner_segment_size(&tuner));
+  upload(flat);
+  TEST_ASSERT_EQUAL(2048, upload_tuner_segment_size(&tuner));
+}
+
+void test_climbs_to_the_best_size()
+{
+  const float rising[UPLOAD_SEGMENT_SIZES] = { 0.2, 0.4, 0.6, 0.8, 1.0 };
+  for (int i = 0; i < 6; i++) {
+    upload(rising);
+  }
+  TEST_ASSERT_EQUAL(UPLOAD_SEGMENT_MAX, upload_tuner_segment_size(&tuner));
+
+  setUp();
+  const float falling[UPLOAD_SEGMENT_SIZES] = { 1.0, 0.8, 0.6, 0.4, 0.2 };
+  for (int i = 0; i < 6; i++) {
+    upload(falling);
+  }
+  TEST_ASSERT_EQUAL(UPLOAD_SEGMENT_MIN, upload_tuner_segment_size(&tuner));
+}
+
+void test_stays_on_the_best_size_between_explorations()
+{
+  const float peak[UPLOAD_SEGMENT_SIZES] = { 0.2, 0.4, 0.6, 1.0, 0.8 };
+  int explored = 0;
+  for (int i = 0; i < 4 * UPLOAD_EXPLORE_EVERY; i++) {
+    upload(peak);
+    explored += upload_tuner_segment_size(&tuner) != 8192;
+  }
+  TEST_ASSERT_EQUAL(3, tuner.best);
+  // the first few uploads try the neighbors, after that one in UPLOAD_EXPLORE_EVERY does
+  TEST_ASSERT_LESS_OR_EQUAL(4 + 4, explored);
+}
+
+void test_follows_a_changing_network()
+{
+  const float large_wins[UPLOAD_SEGMENT_SIZES] = { 0.2, 0.4, 0.6, 0.8, 1.0 };
+  const float small_wins[UPLOAD_SEGMENT_SIZES] = { 1.0, 0.8, 0.6, 0.4, 0.2 };
+  for (int i = 0; i < 20; i++) {
+    upload(large_wins);
+  }
+  TEST_ASSERT_EQUAL(UPLOAD_SEGMENT_MAX, upload_tuner_segment_size(&tuner));
+  for (int i = 0; i < 40; i++) {
+    upload(small_wins);
+  }
+  TEST_ASSERT_EQUAL(UPLOAD_SEGMENT_MIN, upload_tuner_segment_size(&tuner));
+}
+
+void test_ignores_small_uploads()
+{
+  upload_tuner_record(&tuner, 1000, 1);
+  TEST_ASSERT_EQUAL(0, tuner.uploads);
+  TEST_ASSERT_EQUAL(4096, upload_tuner_segment_size(&tuner));
+  // an upload that took under a millisecond still counts
+  upload_tuner_record(&tuner, UPLOAD_TUNE_MIN_BYTES, 0);
+  TEST_ASSERT_EQUAL(1, tuner.uploads);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_starts_at_a_full_record);
+  RUN_TEST(test_tries_neighbors_first);
+  RUN_TEST(test_climbs_to_the_best_size);
+  RUN_TEST(test_stays_on_the_best_size_between_explorations);
+  RUN_TEST(test_follows_a_changing_network);
+  RUN_TEST(test_ignores_small_uploads);
+  return UNITY_END();
+}